@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+# vim: set fileencoding=utf-8 :
+
+# benchmark kakaduload and kakadusave
+#
+# run with eg.:
+#
+#   ./bench/bench.py --size 8192 --output bench.json
+#
+# and compare two runs with:
+#
+#   ./bench/bench.py --compare before.json after.json
+#
+# add --numa to run the decode and encode benchmarks again with numa=True,
+# so they're reported next to the plain runs. Watch cross-socket traffic
+# while it runs with eg. `perf stat -e node-load-misses`.
+
+import argparse
+import json
+import math
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import pyvips
+
+# ratios worse than this are flagged by --compare
+REGRESSION = 0.9
+
+
+# a synthetic RGB image with smooth areas, edges and noise, so it compresses
+# roughly like a photo
+def make_image(size):
+    x = pyvips.Image.xyz(size, size)
+    smooth = (x[0] * 255 / size).bandjoin([x[1] * 255 / size,
+                                            (x[0] + x[1]) * 127 / size])
+    edges = pyvips.Image.sines(size, size, hfreq=size / 128,
+                               vfreq=size / 256) * 64
+    noise = pyvips.Image.gaussnoise(size, size, sigma=8).bandjoin([
+        pyvips.Image.gaussnoise(size, size, sigma=8),
+        pyvips.Image.gaussnoise(size, size, sigma=8)])
+
+    return (smooth + edges + noise).cast("uchar").copy(interpretation="srgb")
+
+
+# run fn a few times and return the fastest, in seconds
+def best_of(fn, repeat):
+    times = []
+    for i in range(repeat):
+        start = time.perf_counter()
+        fn()
+        times.append(time.perf_counter() - start)
+
+    return min(times)
+
+
+# numa=False runs don't record the flag, so their params still match
+# reports from before --numa existed
+def numa_params(params, numa):
+    if numa:
+        params["numa"] = True
+
+    return params
+
+
+def result(kind, params, seconds, pixels, **extra):
+    return dict(kind=kind,
+                params=params,
+                seconds=seconds,
+                mpix_per_second=pixels / seconds / 1e6,
+                **extra)
+
+
+# make the source files for the decode benchmark, one per tile size
+def make_sources(tempdir, size, tile_sizes):
+    image = make_image(size)
+    sources = {}
+    for tile_size in tile_sizes:
+        filename = os.path.join(tempdir, f"source-{tile_size}.jp2")
+        options = "Clevels=6 Cblk={64,64}"
+        if tile_size > 0:
+            options += f" Stiles={{{tile_size},{tile_size}}}"
+        image.kakadusave(filename, options=options)
+        sources[tile_size] = filename
+
+    return sources
+
+
+def bench_decode(sources, pages, region_sizes, repeat, numa_modes):
+    results = []
+    for tile_size, filename in sources.items():
+        for page in pages:
+            for region_size in region_sizes:
+                for numa in numa_modes:
+                    def fn():
+                        image = pyvips.Image.kakaduload(filename, page=page,
+                                                        numa=numa)
+                        if region_size > 0:
+                            width = min(region_size, image.width)
+                            height = min(region_size, image.height)
+                            image = image.crop((image.width - width) // 2,
+                                               (image.height - height) // 2,
+                                               width, height)
+                        fn.pixels = image.width * image.height
+                        image.avg()
+
+                    seconds = best_of(fn, repeat)
+                    params = numa_params(dict(tile_size=tile_size,
+                                              page=page,
+                                              region_size=region_size), numa)
+                    results.append(result("decode", params, seconds,
+                                          fn.pixels))
+
+    return results
+
+
+def bench_encode(tempdir, size, repeat, numa_modes):
+    # encode from memory, so we only time the encoder
+    image = make_image(size).copy_memory()
+    filename = os.path.join(tempdir, "encode.jp2")
+
+    results = []
+    for htj2k in [False, True]:
+        for lossless in [False, True]:
+            for tile_size in [0, 1024]:
+                options = "Creversible=yes" if lossless else "Qfactor=75"
+                if tile_size > 0:
+                    options += f" Stiles={{{tile_size},{tile_size}}}"
+
+                for numa in numa_modes:
+                    def fn():
+                        image.kakadusave(filename,
+                                         options=options,
+                                         lossless=lossless,
+                                         htj2k=htj2k,
+                                         numa=numa)
+
+                    seconds = best_of(fn, repeat)
+                    params = numa_params(dict(htj2k=htj2k,
+                                              lossless=lossless,
+                                              tile_size=tile_size), numa)
+                    results.append(result("encode", params, seconds,
+                                          image.width * image.height,
+                                          bytes=os.path.getsize(filename)))
+
+    return results
+
+
+# PSNR in dB, or None for identical images
+def psnr(a, b):
+    mse = ((a - b) ** 2).avg()
+    return 10 * math.log10(255 ** 2 / mse) if mse > 0 else None
+
+
+# the speed and quality of each preset ... decode error is measured against
+# the precise decode, encode error against the source image
+def bench_presets(tempdir, sources, size, repeat, encode):
+    presets = ["fast", "balanced", "precise"]
+    results = []
+
+    filename = sources[min(sources)]
+    reference = pyvips.Image.kakaduload(filename, preset="precise")
+    reference = reference.copy_memory()
+    for preset in presets:
+        def fn():
+            pyvips.Image.kakaduload(filename, preset=preset).avg()
+
+        seconds = best_of(fn, repeat)
+        image = pyvips.Image.kakaduload(filename, preset=preset)
+        params = dict(tile_size=min(sources), preset=preset)
+        results.append(result("decode", params, seconds,
+                              image.width * image.height,
+                              psnr=psnr(reference, image)))
+
+    if encode:
+        image = make_image(size).copy_memory()
+        filename = os.path.join(tempdir, "preset.jp2")
+        for preset in presets:
+            def fn():
+                image.kakadusave(filename, preset=preset)
+
+            seconds = best_of(fn, repeat)
+            decoded = pyvips.Image.kakaduload(filename, preset="precise")
+            results.append(result("encode", dict(preset=preset), seconds,
+                                  image.width * image.height,
+                                  bytes=os.path.getsize(filename),
+                                  psnr=psnr(image, decoded)))
+
+    return results
+
+
+# run the benchmarks for one thread count ... kakadu reads the thread budget
+# on plugin load, so each thread count needs a new process
+def run_worker(args):
+    pyvips.cache_set_max(0)
+
+    tempdir = tempfile.mkdtemp()
+    try:
+        numa_modes = [False, True] if args.numa else [False]
+        sources = make_sources(tempdir, args.size, args.tile_sizes)
+        results = bench_decode(sources, args.pages, args.region_sizes,
+                               args.repeat, numa_modes)
+        if not args.no_encode:
+            results += bench_encode(tempdir, args.size, args.repeat,
+                                    numa_modes)
+        results += bench_presets(tempdir, sources, args.size, args.repeat,
+                                 not args.no_encode)
+    finally:
+        shutil.rmtree(tempdir, ignore_errors=True)
+
+    json.dump(results, sys.stdout)
+
+
+def run(args):
+    results = []
+    for threads in args.threads:
+        env = dict(os.environ,
+                   VIPS_CONCURRENCY=str(threads),
+                   VIPS_KAKADU_THREADS=str(threads))
+        command = [sys.executable, __file__, "--worker"] + sys.argv[1:]
+        output = subprocess.run(command, env=env, check=True,
+                                stdout=subprocess.PIPE).stdout
+        for item in json.loads(output):
+            item["params"]["threads"] = threads
+            results.append(item)
+            print(f"{item['kind']:6} {item['params']}: "
+                  f"{item['mpix_per_second']:.1f} Mpix/s", file=sys.stderr)
+
+    report = dict(vips_version=pyvips.version(0),
+                  vips_version_minor=pyvips.version(1),
+                  machine=platform.machine(),
+                  cpus=os.cpu_count(),
+                  size=args.size,
+                  results=results)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+    else:
+        json.dump(report, sys.stdout, indent=2)
+
+
+# print the speed ratio for each benchmark in two reports, and fail if any
+# got much slower
+def compare(before_filename, after_filename):
+    with open(before_filename) as f:
+        before = json.load(f)
+    with open(after_filename) as f:
+        after = json.load(f)
+
+    def key(item):
+        return (item["kind"], json.dumps(item["params"], sort_keys=True))
+
+    before_results = {key(item): item for item in before["results"]}
+
+    regressions = 0
+    for item in after["results"]:
+        old = before_results.get(key(item))
+        if not old:
+            continue
+
+        ratio = item["mpix_per_second"] / old["mpix_per_second"]
+        flag = ""
+        if ratio < REGRESSION:
+            flag = " <-- slower"
+            regressions += 1
+        print(f"{item['kind']:6} {item['params']}: {ratio:.2f}x{flag}")
+
+    return 1 if regressions > 0 else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="benchmark kakaduload and kakadusave")
+    parser.add_argument("--size", type=int, default=8192,
+                        help="width and height of the test image")
+    parser.add_argument("--tile-sizes", type=int, nargs="+",
+                        default=[0, 512, 1024],
+                        help="tile sizes to decode, 0 for untiled")
+    parser.add_argument("--pages", type=int, nargs="+", default=[0, 1, 3],
+                        help="pages (shrink levels) to decode")
+    parser.add_argument("--region-sizes", type=int, nargs="+",
+                        default=[512, 2048, 0],
+                        help="region sizes to decode, 0 for the whole page")
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, 4, 16],
+                        help="thread counts to run at")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="run each benchmark this many times")
+    parser.add_argument("--no-encode", action="store_true",
+                        help="skip the encode benchmarks")
+    parser.add_argument("--numa", action="store_true",
+                        help="also decode and encode with numa=True")
+    parser.add_argument("--output", help="write JSON results here")
+    parser.add_argument("--compare", nargs=2,
+                        metavar=("BEFORE", "AFTER"),
+                        help="compare two JSON results files")
+    parser.add_argument("--worker", action="store_true",
+                        help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.compare:
+        return compare(*args.compare)
+    elif args.worker:
+        run_worker(args)
+    else:
+        run(args)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
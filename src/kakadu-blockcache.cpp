@@ -0,0 +1,152 @@
+/* A process-wide cache of compressed source blocks, shared between loads
+ * of the same file.
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+using namespace kdu_supp; // includes the core namespace
+
+/* Compressed blocks are much smaller than the pixels they decode to, so
+ * this covers a lot of image.
+ */
+#define DEFAULT_SHARED_CACHE_MB (256)
+
+typedef std::pair<std::string, kdu_long> VipsKakaduBlockKey;
+
+typedef struct _VipsKakaduSharedBlock {
+	VipsKakaduBlockKey key;
+	kdu_byte *data;
+	int length;
+
+	/* Our place on the LRU list.
+	 */
+	std::list<struct _VipsKakaduSharedBlock *>::iterator link;
+} VipsKakaduSharedBlock;
+
+static GMutex vips_kakadu_block_cache_lock;
+static size_t vips_kakadu_block_cache_max_bytes = 0;
+static size_t vips_kakadu_block_cache_bytes = 0;
+static std::map<VipsKakaduBlockKey, VipsKakaduSharedBlock *>
+	vips_kakadu_block_cache;
+static std::list<VipsKakaduSharedBlock *> vips_kakadu_block_cache_lru;
+
+/* Call once, from plugin init.
+ */
+void
+vips_kakadu_block_cache_init(void)
+{
+	const char *str;
+	int mb;
+
+	mb = DEFAULT_SHARED_CACHE_MB;
+	if ((str = g_getenv("VIPS_KAKADU_SHARED_CACHE")))
+		mb = VIPS_CLIP(0, atoi(str), 1024 * 1024);
+	vips_kakadu_block_cache_max_bytes = (size_t) mb * 1024 * 1024;
+
+#ifdef DEBUG
+	printf("vips_kakadu_block_cache_init: %d MB\n", mb);
+#endif /*DEBUG*/
+}
+
+/* A key which changes if the file changes, or NULL if the source isn't a
+ * file we can stat. Free with g_free().
+ *
+ * Files are often replaced within a second, or by renaming a new file over
+ * the old one, so we need the inode and the nanoseconds of mtime as well.
+ */
+char *
+vips_kakadu_block_cache_key(VipsSource *source)
+{
+	const char *filename;
+	struct stat st;
+
+	if (!(filename = vips_connection_filename(VIPS_CONNECTION(source))) ||
+		stat(filename, &st))
+		return NULL;
+
+	return g_strdup_printf("%s:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+		":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld",
+		filename, 
+		(guint64) st.st_dev, (guint64) st.st_ino,
+		(gint64) st.st_size, 
+		(gint64) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+}
+
+/* A copy of a block, or NULL. Free with g_free().
+ */
+kdu_byte *
+vips_kakadu_block_cache_get(const char *key, kdu_long index, int *length)
+{
+	kdu_byte *data = NULL;
+
+	g_mutex_lock(&vips_kakadu_block_cache_lock);
+
+	auto item = vips_kakadu_block_cache.find(VipsKakaduBlockKey(key, index));
+	if (item != vips_kakadu_block_cache.end()) {
+		VipsKakaduSharedBlock *block = item->second;
+
+		vips_kakadu_block_cache_lru.erase(block->link);
+		vips_kakadu_block_cache_lru.push_front(block);
+		block->link = vips_kakadu_block_cache_lru.begin();
+
+		data = (kdu_byte *) g_malloc(block->length);
+		memcpy(data, block->data, block->length);
+		*length = block->length;
+	}
+
+	g_mutex_unlock(&vips_kakadu_block_cache_lock);
+
+	return data;
+}
+
+/* Add a copy of a block, evicting the least recently used blocks to stay in
+ * budget.
+ */
+void
+vips_kakadu_block_cache_put(const char *key, kdu_long index,
+	const kdu_byte *data, int length)
+{
+	if ((size_t) length > vips_kakadu_block_cache_max_bytes)
+		return;
+
+	g_mutex_lock(&vips_kakadu_block_cache_lock);
+
+	VipsKakaduBlockKey block_key(key, index);
+	if (!vips_kakadu_block_cache.count(block_key)) {
+		while (vips_kakadu_block_cache_bytes + length >
+			vips_kakadu_block_cache_max_bytes) {
+			VipsKakaduSharedBlock *oldest = vips_kakadu_block_cache_lru.back();
+
+			vips_kakadu_block_cache_lru.pop_back();
+			vips_kakadu_block_cache.erase(oldest->key);
+			vips_kakadu_block_cache_bytes -= oldest->length;
+			g_free(oldest->data);
+			delete oldest;
+		}
+
+		VipsKakaduSharedBlock *block = new VipsKakaduSharedBlock();
+		block->key = block_key;
+		block->data = (kdu_byte *) g_malloc(length);
+		memcpy(block->data, data, length);
+		block->length = length;
+		vips_kakadu_block_cache_lru.push_front(block);
+		block->link = vips_kakadu_block_cache_lru.begin();
+		vips_kakadu_block_cache[block_key] = block;
+		vips_kakadu_block_cache_bytes += length;
+	}
+
+	g_mutex_unlock(&vips_kakadu_block_cache_lock);
+}
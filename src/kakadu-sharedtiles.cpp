@@ -0,0 +1,168 @@
+/* A cache of decoded tiles shared between processes, as files in a
+ * directory, usually on tmpfs.
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utime.h>
+
+#include <algorithm>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+/* Check the size of the cache every this many puts.
+ */
+#define TRIM_INTERVAL (64)
+
+#define DEFAULT_SHARED_TILES_MB (1024)
+
+/* NULL means the shared tile cache is off.
+ */
+static char *vips_kakadu_shared_tiles_dir = NULL;
+static size_t vips_kakadu_shared_tiles_max_bytes = 0;
+static int vips_kakadu_shared_tiles_puts = 0;
+
+/* Call once, from plugin init. Set VIPS_KAKADU_TILE_CACHE to a directory
+ * to turn the cache on, and VIPS_KAKADU_TILE_CACHE_MB to set the size.
+ */
+void
+vips_kakadu_shared_tiles_init(void)
+{
+	const char *dir;
+	const char *str;
+
+	if (!(dir = g_getenv("VIPS_KAKADU_TILE_CACHE")) ||
+		dir[0] == '\0')
+		return;
+
+	if (g_mkdir_with_parents(dir, 0700)) {
+		g_warning("unable to make tile cache directory %s", dir);
+		return;
+	}
+
+	int mb = DEFAULT_SHARED_TILES_MB;
+	if ((str = g_getenv("VIPS_KAKADU_TILE_CACHE_MB")))
+		mb = VIPS_CLIP(1, atoi(str), 1024 * 1024);
+
+	vips_kakadu_shared_tiles_dir = g_strdup(dir);
+	vips_kakadu_shared_tiles_max_bytes = (size_t) mb * 1024 * 1024;
+
+#ifdef DEBUG
+	printf("vips_kakadu_shared_tiles_init: %s, %d MB\n", dir, mb);
+#endif /*DEBUG*/
+}
+
+bool
+vips_kakadu_shared_tiles_enabled(void)
+{
+	return vips_kakadu_shared_tiles_dir != NULL;
+}
+
+/* Keys can be long and contain any character, so we name files by hash.
+ */
+static char *
+vips_kakadu_shared_tiles_path(const char *key)
+{
+	g_autofree char *hash =
+		g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+
+	return g_build_filename(vips_kakadu_shared_tiles_dir, hash, NULL);
+}
+
+/* Delete the least recently used files until we're well under budget.
+ * Several processes can do this at once, and that's harmless.
+ */
+static void
+vips_kakadu_shared_tiles_trim(void)
+{
+	GDir *dir;
+	const char *name;
+
+	if (!(dir = g_dir_open(vips_kakadu_shared_tiles_dir, 0, NULL)))
+		return;
+
+	std::vector<std::pair<time_t, std::string>> files;
+	size_t bytes = 0;
+	while ((name = g_dir_read_name(dir))) {
+		g_autofree char *path =
+			g_build_filename(vips_kakadu_shared_tiles_dir, name, NULL);
+		GStatBuf st;
+
+		if (!g_stat(path, &st)) {
+			files.push_back(std::make_pair(st.st_mtime, std::string(path)));
+			bytes += st.st_size;
+		}
+	}
+	g_dir_close(dir);
+
+	if (bytes <= vips_kakadu_shared_tiles_max_bytes)
+		return;
+
+	std::sort(files.begin(), files.end());
+	size_t target = vips_kakadu_shared_tiles_max_bytes / 4 * 3;
+	for (auto &file : files) {
+		if (bytes <= target)
+			break;
+
+		GStatBuf st;
+		if (!g_stat(file.second.c_str(), &st) &&
+			!g_unlink(file.second.c_str()))
+			bytes -= st.st_size;
+	}
+
+#ifdef DEBUG
+	printf("vips_kakadu_shared_tiles_trim: %zd bytes left\n", bytes);
+#endif /*DEBUG*/
+}
+
+/* A tile of exactly length bytes, or NULL.
+ */
+VipsBlob *
+vips_kakadu_shared_tiles_get(const char *key, size_t length)
+{
+	g_autofree char *path = vips_kakadu_shared_tiles_path(key);
+	char *data;
+	gsize data_length;
+
+	if (!g_file_get_contents(path, &data, &data_length, NULL))
+		return NULL;
+
+	// a truncated or damaged file
+	if (data_length != length) {
+		g_free(data);
+		return NULL;
+	}
+
+	// mark as recently used
+	(void) utime(path, NULL);
+
+	return vips_blob_new((VipsCallbackFn) vips_area_free_cb,
+		data, data_length);
+}
+
+/* Files are written to a temporary name and renamed, so readers never see
+ * part of a tile.
+ */
+void
+vips_kakadu_shared_tiles_put(const char *key, VipsBlob *tile)
+{
+	g_autofree char *path = vips_kakadu_shared_tiles_path(key);
+	size_t length;
+	const void *data = vips_blob_get(tile, &length);
+
+	if (!g_file_set_contents(path, (const char *) data, length, NULL))
+		return;
+
+	if (g_atomic_int_add(&vips_kakadu_shared_tiles_puts, 1) %
+		TRIM_INTERVAL == 0)
+		vips_kakadu_shared_tiles_trim();
+}
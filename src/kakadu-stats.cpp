@@ -0,0 +1,56 @@
+/* Performance counters for load and save.
+ */
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+using namespace kdu_supp; // includes the core namespace
+
+/* Counters can be updated from several threads at once, eg. by the save
+ * write-behind thread and the main thread.
+ */
+static GMutex vips_kakadu_stats_lock;
+
+/* A new set of counters, all zero.
+ */
+VipsArea *
+vips_kakadu_stats_new(void)
+{
+	static const double zero[VIPS_KAKADU_STATS_LAST] = { 0 };
+
+	return VIPS_AREA(vips_array_double_new(zero, VIPS_KAKADU_STATS_LAST));
+}
+
+void
+vips_kakadu_stats_add(VipsArea *stats, VipsKakaduStat stat, double value)
+{
+	if (stats) {
+		g_mutex_lock(&vips_kakadu_stats_lock);
+		((double *) stats->data)[stat] += value;
+		g_mutex_unlock(&vips_kakadu_stats_lock);
+	}
+}
+
+void
+vips_kakadu_stats_max(VipsArea *stats, VipsKakaduStat stat, double value)
+{
+	if (stats) {
+		g_mutex_lock(&vips_kakadu_stats_lock);
+		double *counters = (double *) stats->data;
+		counters[stat] = VIPS_MAX(counters[stat], value);
+		g_mutex_unlock(&vips_kakadu_stats_lock);
+	}
+}
+
+/* Track the peak memory kakadu has used for this codestream.
+ */
+void
+vips_kakadu_stats_memory(VipsArea *stats, kdu_codestream codestream)
+{
+	if (stats &&
+		codestream.exists())
+		vips_kakadu_stats_max(stats, VIPS_KAKADU_STATS_MEMORY,
+			codestream.get_compressed_data_memory(true) +
+			codestream.get_compressed_state_memory(true));
+}
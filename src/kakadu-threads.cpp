@@ -0,0 +1,277 @@
+/* A plugin-wide pool of kakadu worker threads.
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_NUMA
+#include <sched.h>
+#include <numa.h>
+#endif /*HAVE_NUMA*/
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+using namespace kdu_supp; // includes the core namespace
+
+/* 16 seems like a sensible limit for one operation ... beyond this, kakadu
+ * spends more time synchronising than working.
+ */
+#define MAX_THREADS_PER_OPERATION (16)
+
+/* A kakadu thread group belongs to the thread that made it, and only that
+ * thread can hand work to it. libvips calls us from many worker threads, so
+ * we can't share a single group. Instead, we keep a set of groups and lend
+ * one to each operation, passing ownership to the borrowing thread.
+ *
+ * Groups made for a NUMA operation have all their threads on one node, and
+ * are only lent to operations running on that node.
+ *
+ * All counts are worker threads, not including the owner thread.
+ */
+typedef struct _VipsKakaduThreadGroup {
+	kdu_thread_env *env;
+
+	/* The node the threads are bound to, or -1 for any.
+	 */
+	int node;
+} VipsKakaduThreadGroup;
+
+static GMutex vips_kakadu_threads_lock;
+
+/* The most worker threads we allow, over all operations.
+ */
+static int vips_kakadu_threads_budget = 0;
+
+/* Threads in groups currently on loan, and the number of loans.
+ */
+static int vips_kakadu_threads_active = 0;
+static int vips_kakadu_threads_users = 0;
+
+/* Idle VipsKakaduThreadGroup, and the number of threads they hold.
+ */
+static GSList *vips_kakadu_threads_free = NULL;
+static int vips_kakadu_threads_idle = 0;
+
+static int
+vips_kakadu_threads_count(kdu_thread_env *env)
+{
+	return env->get_num_threads() - 1;
+}
+
+/* Call once, from plugin init.
+ */
+void
+vips_kakadu_threads_init(void)
+{
+	const char *str;
+
+	vips_kakadu_threads_budget = vips_concurrency_get();
+	if ((str = g_getenv("VIPS_KAKADU_THREADS")))
+		vips_kakadu_threads_budget = VIPS_CLIP(0, atoi(str), 1024);
+
+#ifdef DEBUG
+	printf("vips_kakadu_threads_init: budget = %d\n",
+		vips_kakadu_threads_budget);
+#endif /*DEBUG*/
+}
+
+/* True if the whole budget is on loan, so background work should wait.
+ */
+bool
+vips_kakadu_threads_busy(void)
+{
+	bool busy;
+
+	g_mutex_lock(&vips_kakadu_threads_lock);
+	busy = vips_kakadu_threads_users > 0 &&
+		vips_kakadu_threads_active >= vips_kakadu_threads_budget;
+	g_mutex_unlock(&vips_kakadu_threads_lock);
+
+	return busy;
+}
+
+/* Borrow a group with a fair share of the budget, or NULL for no worker
+ * threads. If node is not -1, the calling thread must already be bound to
+ * that node, so any new threads start there too.
+ */
+static kdu_thread_env *
+vips_kakadu_threads_acquire(int node)
+{
+	kdu_thread_env *env;
+	int share;
+
+	g_mutex_lock(&vips_kakadu_threads_lock);
+
+	// earlier users keep what they have until they finish, so new users
+	// may get less than an even split for a while
+	vips_kakadu_threads_users += 1;
+	share = vips_kakadu_threads_budget / vips_kakadu_threads_users;
+	share = VIPS_MIN(share, MAX_THREADS_PER_OPERATION);
+	share = VIPS_MIN(share,
+		vips_kakadu_threads_budget - vips_kakadu_threads_active);
+	share = VIPS_MAX(share, 0);
+
+	// the largest idle group on our node that fits in our share
+	VipsKakaduThreadGroup *group = NULL;
+	for (GSList *p = vips_kakadu_threads_free; p; p = p->next) {
+		VipsKakaduThreadGroup *this_group =
+			(VipsKakaduThreadGroup *) p->data;
+		int n = vips_kakadu_threads_count(this_group->env);
+
+		if (this_group->node == node &&
+			n <= share &&
+			(!group || n > vips_kakadu_threads_count(group->env)))
+			group = this_group;
+	}
+
+	env = NULL;
+	if (group) {
+		env = group->env;
+		int n = vips_kakadu_threads_count(env);
+
+		vips_kakadu_threads_free =
+			g_slist_remove(vips_kakadu_threads_free, group);
+		g_free(group);
+		vips_kakadu_threads_idle -= n;
+		vips_kakadu_threads_active += n;
+	}
+	else
+		// reserve our share while we make a new group
+		vips_kakadu_threads_active += share;
+
+	g_mutex_unlock(&vips_kakadu_threads_lock);
+
+	if (env)
+		env->change_group_owner_thread();
+	else if (share > 0) {
+		env = new kdu_thread_env();
+		env->create();
+
+		int n;
+		for (n = 0; n < share; n++)
+			if (!env->add_thread())
+				break;
+
+		// we might have made fewer threads than we asked for
+		g_mutex_lock(&vips_kakadu_threads_lock);
+		vips_kakadu_threads_active -= share - n;
+		g_mutex_unlock(&vips_kakadu_threads_lock);
+
+		if (n == 0) {
+			env->destroy();
+			DELETE(env);
+		}
+	}
+
+#ifdef DEBUG
+	printf("vips_kakadu_threads_acquire: %d threads on node %d, "
+		"%d active, %d users\n",
+		env ? vips_kakadu_threads_count(env) : 0,
+		node,
+		vips_kakadu_threads_active,
+		vips_kakadu_threads_users);
+#endif /*DEBUG*/
+
+	return env;
+}
+
+/* Return a group to the pool, or shut it down if it can't be reused, or if
+ * the pool is over budget.
+ */
+static void
+vips_kakadu_threads_release(kdu_thread_env *env, int node, bool reuse)
+{
+	int n = env ? vips_kakadu_threads_count(env) : 0;
+
+	g_mutex_lock(&vips_kakadu_threads_lock);
+
+	vips_kakadu_threads_users -= 1;
+	vips_kakadu_threads_active -= n;
+
+	if (env &&
+		reuse &&
+		vips_kakadu_threads_active + vips_kakadu_threads_idle + n <=
+			vips_kakadu_threads_budget) {
+		VipsKakaduThreadGroup *group = g_new(VipsKakaduThreadGroup, 1);
+
+		group->env = env;
+		group->node = node;
+		vips_kakadu_threads_free =
+			g_slist_prepend(vips_kakadu_threads_free, group);
+		vips_kakadu_threads_idle += n;
+		env = NULL;
+	}
+
+	g_mutex_unlock(&vips_kakadu_threads_lock);
+
+	if (env) {
+		// only the owner can shut a group down
+		env->change_group_owner_thread();
+		env->destroy();
+		delete env;
+	}
+}
+
+/* With numa set, bind the calling thread to the node it's running on for
+ * our lifetime. Kakadu threads we start inherit this binding, and the memory
+ * they allocate and touch (and the libvips pixel buffers the calling thread
+ * touches) then stays on one node.
+ */
+VipsKakaduThreads::VipsKakaduThreads(bool numa)
+{
+#ifdef HAVE_NUMA
+	if (numa &&
+		numa_available() >= 0) {
+		int cpu = sched_getcpu();
+
+		if (cpu >= 0 &&
+			(node = numa_node_of_cpu(cpu)) >= 0) {
+			struct bitmask *mask = numa_allocate_cpumask();
+
+			if (numa_sched_getaffinity(0, mask) < 0 ||
+				numa_run_on_node(node)) {
+				numa_free_cpumask(mask);
+				node = -1;
+			}
+			else
+				affinity = mask;
+		}
+		else
+			node = -1;
+	}
+#endif /*HAVE_NUMA*/
+
+	env = vips_kakadu_threads_acquire(node);
+}
+
+VipsKakaduThreads::~VipsKakaduThreads()
+{
+	vips_kakadu_threads_release(env, node, reuse);
+
+#ifdef HAVE_NUMA
+	if (affinity) {
+		struct bitmask *mask = (struct bitmask *) affinity;
+
+		// put the calling thread back where it was
+		numa_sched_setaffinity(0, mask);
+		numa_free_cpumask(mask);
+	}
+#endif /*HAVE_NUMA*/
+}
+
+/* Detach the group from this codestream, ready to be used with another.
+ */
+void
+VipsKakaduThreads::finished(kdu_codestream codestream)
+{
+	if (env) {
+		env->cs_terminate(codestream);
+		reuse = true;
+	}
+}
@@ -0,0 +1,155 @@
+/* A byte-limited cache of decoded tiles.
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+/* The protected segment can hold this fraction of the budget.
+ */
+#define HOT_FRACTION (0.75)
+
+static size_t
+vips_kakadu_tile_length(VipsBlob *tile)
+{
+	return VIPS_AREA(tile)->length;
+}
+
+VipsKakaduTileCache::VipsKakaduTileCache(size_t _max_bytes)
+{
+	g_mutex_init(&lock);
+	max_bytes = _max_bytes;
+	max_hot_bytes = max_bytes * HOT_FRACTION;
+}
+
+VipsKakaduTileCache::~VipsKakaduTileCache()
+{
+	for (auto &item : entries) {
+		vips_area_unref(VIPS_AREA(item.second->tile));
+		delete item.second;
+	}
+
+	g_mutex_clear(&lock);
+}
+
+/* Unlink and free an entry. Call with the lock held.
+ */
+void
+VipsKakaduTileCache::remove(Entry *entry)
+{
+	size_t length = vips_kakadu_tile_length(entry->tile);
+
+	if (entry->hot) {
+		hot.erase(entry->link);
+		hot_bytes -= length;
+	}
+	else
+		cold.erase(entry->link);
+	bytes -= length;
+	entries.erase(entry->index);
+
+	vips_area_unref(VIPS_AREA(entry->tile));
+	delete entry;
+}
+
+/* Demote the oldest protected tiles while the protected segment is over
+ * budget, then evict the oldest probationary tiles while we're over budget.
+ * Call with the lock held.
+ */
+void
+VipsKakaduTileCache::trim()
+{
+	while (hot_bytes > max_hot_bytes &&
+		!hot.empty()) {
+		Entry *oldest = hot.back();
+
+		hot.pop_back();
+		hot_bytes -= vips_kakadu_tile_length(oldest->tile);
+		cold.push_front(oldest);
+		oldest->link = cold.begin();
+		oldest->hot = false;
+	}
+
+	while (bytes > max_bytes &&
+		!entries.empty())
+		remove(cold.empty() ? hot.back() : cold.back());
+}
+
+VipsBlob *
+VipsKakaduTileCache::get(int index)
+{
+	VipsBlob *tile = NULL;
+
+	g_mutex_lock(&lock);
+
+	auto item = entries.find(index);
+	if (item != entries.end()) {
+		Entry *entry = item->second;
+
+		// a hit moves the tile to the front of the protected segment
+		if (entry->hot)
+			hot.erase(entry->link);
+		else {
+			cold.erase(entry->link);
+			hot_bytes += vips_kakadu_tile_length(entry->tile);
+		}
+		hot.push_front(entry);
+		entry->link = hot.begin();
+		entry->hot = true;
+		trim();
+
+		tile = entry->tile;
+		vips_area_ref(VIPS_AREA(tile));
+	}
+
+	g_mutex_unlock(&lock);
+
+	return tile;
+}
+
+void
+VipsKakaduTileCache::put(int index, VipsBlob *tile)
+{
+	g_mutex_lock(&lock);
+
+	auto item = entries.find(index);
+	if (item != entries.end())
+		remove(item->second);
+
+	Entry *entry = new Entry();
+	entry->index = index;
+	entry->tile = tile;
+	vips_area_ref(VIPS_AREA(tile));
+	cold.push_front(entry);
+	entry->link = cold.begin();
+	entry->hot = false;
+	entries[index] = entry;
+	bytes += vips_kakadu_tile_length(tile);
+	trim();
+
+#ifdef DEBUG
+	printf("VipsKakaduTileCache::put: %zd tiles, %zd bytes\n",
+		entries.size(), bytes);
+#endif /*DEBUG*/
+
+	g_mutex_unlock(&lock);
+}
+
+size_t
+VipsKakaduTileCache::get_bytes()
+{
+	size_t result;
+
+	g_mutex_lock(&lock);
+	result = bytes;
+	g_mutex_unlock(&lock);
+
+	return result;
+}
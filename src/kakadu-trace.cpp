@@ -0,0 +1,226 @@
+/* Timed trace spans, dumped as Chrome trace-event JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+/* Keep at most this many events per thread. Older events are overwritten,
+ * so long-lived processes can trace forever in bounded memory.
+ */
+#define DEFAULT_TRACE_EVENTS (65536)
+
+/* Set from VIPS_KAKADU_TRACE at plugin init, and never changed after that.
+ */
+bool vips_kakadu_trace_enabled = false;
+
+typedef struct _VipsKakaduTraceEvent {
+	const char *name;
+	gint64 start;
+	gint64 stop;
+	VipsRect area;
+} VipsKakaduTraceEvent;
+
+/* Each thread records events to its own ring, so recording only takes an
+ * uncontended lock. The rings are never freed, since we need them at exit,
+ * after the threads have gone.
+ */
+typedef struct _VipsKakaduTraceThread {
+	int id;
+	GMutex lock;
+	std::vector<VipsKakaduTraceEvent> events;
+
+	/* Where the next event goes, once the ring is full.
+	 */
+	size_t next;
+} VipsKakaduTraceThread;
+
+static GMutex vips_kakadu_trace_lock;
+static GSList *vips_kakadu_trace_threads = NULL;
+static int vips_kakadu_trace_n_threads = 0;
+static char *vips_kakadu_trace_filename = NULL;
+static size_t vips_kakadu_trace_max_events = DEFAULT_TRACE_EVENTS;
+
+/* Set by SIGUSR2, and cleared by the next thread to record an event, which
+ * then writes the trace file.
+ */
+static volatile sig_atomic_t vips_kakadu_trace_dump_requested = 0;
+
+static thread_local VipsKakaduTraceThread *vips_kakadu_trace_thread = NULL;
+
+void
+vips_kakadu_trace_record(const char *name, gint64 start, gint64 stop,
+	const VipsRect *area)
+{
+	if (vips_kakadu_trace_dump_requested) {
+		vips_kakadu_trace_dump_requested = 0;
+		if (vips_kakadu_trace_dump(NULL))
+			g_warning("%s", vips_error_buffer());
+	}
+
+	if (!vips_kakadu_trace_thread) {
+		VipsKakaduTraceThread *thread = new VipsKakaduTraceThread();
+
+		g_mutex_init(&thread->lock);
+		thread->next = 0;
+
+		g_mutex_lock(&vips_kakadu_trace_lock);
+		thread->id = vips_kakadu_trace_n_threads++;
+		vips_kakadu_trace_threads =
+			g_slist_prepend(vips_kakadu_trace_threads, thread);
+		g_mutex_unlock(&vips_kakadu_trace_lock);
+
+		vips_kakadu_trace_thread = thread;
+	}
+
+	VipsKakaduTraceThread *thread = vips_kakadu_trace_thread;
+	VipsKakaduTraceEvent event = { name, start, stop, { 0, 0, 0, 0 } };
+	if (area)
+		event.area = *area;
+
+	g_mutex_lock(&thread->lock);
+	if (thread->events.size() < vips_kakadu_trace_max_events)
+		thread->events.push_back(event);
+	else {
+		thread->events[thread->next] = event;
+		thread->next = (thread->next + 1) % thread->events.size();
+	}
+	g_mutex_unlock(&thread->lock);
+}
+
+/* Write the most recent events as Chrome trace-event JSON. Load the file
+ * into chrome://tracing or https://ui.perfetto.dev to view it. A NULL
+ * filename means the VIPS_KAKADU_TRACE file.
+ *
+ * This is safe to call while other threads are recording, so servers can
+ * dump a trace without exiting.
+ */
+int
+vips_kakadu_trace_dump(const char *filename)
+{
+	FILE *fp;
+
+	if (!filename)
+		filename = vips_kakadu_trace_filename;
+	if (!filename) {
+		vips_error("kakadu", "%s", _("tracing is not enabled"));
+		return -1;
+	}
+
+	if (!(fp = fopen(filename, "w"))) {
+		vips_error_system(errno, "kakadu",
+			_("unable to write trace to %s"), filename);
+		return -1;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+
+	g_mutex_lock(&vips_kakadu_trace_lock);
+
+	int pid = getpid();
+	gboolean first = TRUE;
+	for (GSList *p = vips_kakadu_trace_threads; p; p = p->next) {
+		VipsKakaduTraceThread *thread = (VipsKakaduTraceThread *) p->data;
+
+		g_mutex_lock(&thread->lock);
+
+		// oldest first
+		size_t n = thread->events.size();
+		for (size_t i = 0; i < n; i++) {
+			VipsKakaduTraceEvent &event =
+				thread->events[(thread->next + i) % n];
+
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\","
+				"\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+				"\"pid\":%d,\"tid\":%d",
+				first ? "" : ",\n",
+				event.name,
+				event.start,
+				event.stop - event.start,
+				pid,
+				thread->id);
+
+			if (event.area.width > 0)
+				fprintf(fp, ",\"args\":{\"left\":%d,\"top\":%d,"
+					"\"width\":%d,\"height\":%d}",
+					event.area.left, event.area.top,
+					event.area.width, event.area.height);
+
+			fprintf(fp, "}");
+			first = FALSE;
+		}
+
+		g_mutex_unlock(&thread->lock);
+	}
+
+	g_mutex_unlock(&vips_kakadu_trace_lock);
+
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp)) {
+		vips_error_system(errno, "kakadu",
+			_("unable to write trace to %s"), filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+vips_kakadu_trace_atexit(void)
+{
+	if (vips_kakadu_trace_dump(NULL))
+		g_warning("%s", vips_error_buffer());
+}
+
+/* We can't do IO in a signal handler, so just flag the request.
+ */
+static void
+vips_kakadu_trace_signal(int signum)
+{
+	vips_kakadu_trace_dump_requested = 1;
+}
+
+/* Call once, from plugin init. Set VIPS_KAKADU_TRACE to a filename to
+ * record spans and write them to that file on exit, or on SIGUSR2. Set
+ * VIPS_KAKADU_TRACE_EVENTS to the number of events to keep per thread.
+ *
+ * We only take SIGUSR2 if nothing else has, so we never replace a handler
+ * the host application installed.
+ */
+void
+vips_kakadu_trace_init(void)
+{
+	const char *filename;
+	const char *str;
+
+	if ((filename = g_getenv("VIPS_KAKADU_TRACE")) &&
+		filename[0] != '\0') {
+		vips_kakadu_trace_filename = g_strdup(filename);
+		if ((str = g_getenv("VIPS_KAKADU_TRACE_EVENTS")))
+			vips_kakadu_trace_max_events =
+				VIPS_CLIP(1, atoi(str), 100 * 1000 * 1000);
+		vips_kakadu_trace_enabled = true;
+		atexit(vips_kakadu_trace_atexit);
+
+		struct sigaction old_action;
+		if (!sigaction(SIGUSR2, NULL, &old_action) &&
+			!(old_action.sa_flags & SA_SIGINFO) &&
+			old_action.sa_handler == SIG_DFL) {
+			struct sigaction action = { };
+			action.sa_handler = vips_kakadu_trace_signal;
+			action.sa_flags = SA_RESTART;
+			sigemptyset(&action.sa_mask);
+			sigaction(SIGUSR2, &action, NULL);
+		}
+		else
+			g_warning("%s", _("SIGUSR2 is in use, "
+				"call vips_kakadu_trace_dump() to write the trace"));
+	}
+}
@@ -5,6 +5,30 @@
 
 #include "kakadu.h"
 
+GType
+vips_kakadu_preset_get_type(void)
+{
+	static GType etype = 0;
+
+	if (etype == 0) {
+		static const GEnumValue values[] = {
+			{ VIPS_KAKADU_PRESET_FAST, 
+				"VIPS_KAKADU_PRESET_FAST", "fast" },
+			{ VIPS_KAKADU_PRESET_BALANCED, 
+				"VIPS_KAKADU_PRESET_BALANCED", "balanced" },
+			{ VIPS_KAKADU_PRESET_PRECISE, 
+				"VIPS_KAKADU_PRESET_PRECISE", "precise" },
+			{ VIPS_KAKADU_PRESET_LAST, 
+				"VIPS_KAKADU_PRESET_LAST", "last" },
+			{ 0, NULL, NULL }
+		};
+
+		etype = g_enum_register_static("VipsKakaduPreset", values);
+	}
+
+	return etype;
+}
+
 extern "C" {
 const gchar *
 g_module_check_init(GModule *module)
@@ -15,6 +39,10 @@ g_module_check_init(GModule *module)
 	vips_foreign_save_kakadu_file_get_type();
 	vips_foreign_save_kakadu_buffer_get_type();
 	vips_foreign_save_kakadu_target_get_type();
+	vips_kakadutranscode_get_type();
+	vips_kakaduextract_get_type();
+	vips_kakaduplan_get_type();
+	vips_kakadudzsave_get_type();
 
 	g_module_make_resident(module);
 
@@ -22,6 +50,11 @@ g_module_check_init(GModule *module)
 	kdu_customize_errors(&vips_foreign_kakadu_error_handler);
 	kdu_customize_warnings(&vips_foreign_kakadu_warn_handler);
 
+	vips_kakadu_threads_init();
+	vips_kakadu_block_cache_init();
+	vips_kakadu_shared_tiles_init();
+	vips_kakadu_trace_init();
+
 	return NULL; 
 }
 }
@@ -4,6 +4,9 @@
 #include <iostream>
 
 #include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
 #include <string>
 #include <numeric>
 
@@ -46,6 +49,10 @@ GType vips_foreign_load_kakadu_source_get_type(void);
 GType vips_foreign_save_kakadu_file_get_type(void);
 GType vips_foreign_save_kakadu_buffer_get_type(void);
 GType vips_foreign_save_kakadu_target_get_type(void);
+GType vips_kakadutranscode_get_type(void);
+GType vips_kakaduextract_get_type(void);
+GType vips_kakaduplan_get_type(void);
+GType vips_kakadudzsave_get_type(void);
 }
 
 // C API wrappers
@@ -56,8 +63,28 @@ int vips_kakaduload_source(VipsSource *source, VipsImage **out, ...);
 int vips_kakadusave(VipsImage *in, const char *filename, ...);
 int vips_kakadusave_buffer(VipsImage *in, void **buf, size_t *len, ...);
 int vips_kakadusave_target(VipsImage *in, VipsTarget *target, ...);
+int vips_kakadutranscode(const char *filename, const char *output, ...);
+int vips_kakaduextract(const char *filename, const char *output,
+	int left, int top, int width, int height, ...);
+int vips_kakaduplan(VipsSource *source, VipsArrayDouble **ranges, ...);
+int vips_kakadudzsave(const char *filename, const char *output, ...);
 }
 
+/* Trade speed against precision in load and save.
+ */
+typedef enum {
+	VIPS_KAKADU_PRESET_FAST,
+	VIPS_KAKADU_PRESET_BALANCED,
+	VIPS_KAKADU_PRESET_PRECISE,
+	VIPS_KAKADU_PRESET_LAST
+} VipsKakaduPreset;
+
+extern "C" {
+GType vips_kakadu_preset_get_type(void);
+}
+
+#define VIPS_TYPE_KAKADU_PRESET (vips_kakadu_preset_get_type())
+
 class VipsForeignKakaduError : public kdu_core::kdu_thread_safe_message {
 public:
     void 
@@ -113,5 +140,422 @@ private:
     std::vector<std::string> strings;
 };
 
+/* Performance counters for a load or save. These are held in a
+ * VipsArrayDouble, shared with the "kakadu-stats" metadata item on load and
+ * the "stats" output of save, so this order is part of the API.
+ */
+typedef enum {
+	VIPS_KAKADU_STATS_BYTES_READ,
+	VIPS_KAKADU_STATS_READS,
+	VIPS_KAKADU_STATS_SEEKS,
+	VIPS_KAKADU_STATS_BYTES_WRITTEN,
+	VIPS_KAKADU_STATS_WRITES,
+	VIPS_KAKADU_STATS_TILES,
+	VIPS_KAKADU_STATS_PROCESS_USEC,
+	VIPS_KAKADU_STATS_THREADS,
+	VIPS_KAKADU_STATS_MEMORY,
+	VIPS_KAKADU_STATS_LAST
+} VipsKakaduStat;
+
+VipsArea *vips_kakadu_stats_new(void);
+void vips_kakadu_stats_add(VipsArea *stats, VipsKakaduStat stat, double value);
+void vips_kakadu_stats_max(VipsArea *stats, VipsKakaduStat stat, double value);
+void vips_kakadu_stats_memory(VipsArea *stats,
+	kdu_core::kdu_codestream codestream);
+
+/* The default size of the blocks VipsKakaduSource reads and caches.
+ */
+#define VIPS_KAKADU_BLOCK_SIZE (64 * 1024)
+
+/* The largest tile kakaduload caches. Untiled images have a single tile the
+ * size of the image, and caching a few rows of those would need memory in
+ * proportion to the image area.
+ */
+#define VIPS_KAKADU_MAX_CACHE_TILE_SIZE (1024)
+
+/* An offset and length in a source.
+ */
+typedef std::pair<kdu_core::kdu_long, kdu_core::kdu_long> VipsKakaduRange;
+
+/* Compressed blocks, shared between all loads of the same file.
+ */
+void vips_kakadu_block_cache_init(void);
+char *vips_kakadu_block_cache_key(VipsSource *source);
+kdu_core::kdu_byte *vips_kakadu_block_cache_get(const char *key,
+	kdu_core::kdu_long index, int *length);
+void vips_kakadu_block_cache_put(const char *key, kdu_core::kdu_long index,
+	const kdu_core::kdu_byte *data, int length);
+
+/* Decoded tiles, shared between processes. Set VIPS_KAKADU_TILE_CACHE to
+ * a directory to enable.
+ */
+void vips_kakadu_shared_tiles_init(void);
+bool vips_kakadu_shared_tiles_enabled(void);
+VipsBlob *vips_kakadu_shared_tiles_get(const char *key, size_t length);
+void vips_kakadu_shared_tiles_put(const char *key, VipsBlob *tile);
+
+/* A VipsSource as a Kakadu input object. This keeps the reference
+ * alive while it's alive.
+ *
+ * Kakadu parses headers with many tiny reads, and these can be very slow
+ * on network filesystems or object stores, so we read whole blocks and keep
+ * a small cache of them. Blocks which are hit more than once (eg. the main
+ * header, or TLM markers) are protected from eviction by sequential reads.
+ * Readahead grows while reads are sequential, and drops back to a single
+ * block after a seek.
+ *
+ * Set block_size to zero to send every read straight to the VipsSource.
+ */
+class VipsKakaduSource : public kdu_core::kdu_compressed_source {
+public:
+	VipsKakaduSource(VipsSource *_source, 
+		int _block_size = VIPS_KAKADU_BLOCK_SIZE);
+	~VipsKakaduSource();
+
+	virtual int get_capabilities();
+	virtual bool seek(kdu_core::kdu_long offset);
+	virtual kdu_core::kdu_long get_pos();
+	virtual int read(kdu_core::kdu_byte *buf, int num_bytes);
+	void rewind();
+	virtual bool close();
+
+	/* Count reads and seeks here. We don't keep a reference.
+	 */
+	void set_stats(VipsArea *_stats)
+	{
+		stats = _stats;
+	}
+
+	/* Append each range kakadu reads to ranges, merged with the previous
+	 * range if they touch. We don't own the vector.
+	 */
+	void set_ranges(std::vector<VipsKakaduRange> *_ranges)
+	{
+		ranges = _ranges;
+	}
+
+	/* Share blocks with other sources for the same file, using this key
+	 * from vips_kakadu_block_cache_key(). Blocks are indexed, so only
+	 * sources with the same block size can share them.
+	 */
+	void set_shared(const char *key)
+	{
+		shared_key = std::string(key) + 
+			" block " + std::to_string(block_size);
+	}
+
+	/* Serve reads which fall in this range from data, not from the source.
+	 * data must stay valid while we're alive.
+	 */
+	void prefetch(kdu_core::kdu_long offset, kdu_core::kdu_long length,
+		const kdu_core::kdu_byte *data);
+
+private:
+	typedef struct _Block {
+		kdu_core::kdu_long index;
+		kdu_core::kdu_byte *data;
+		int length;
+
+		/* Which list we're on, and where.
+		 */
+		bool hot;
+		std::list<struct _Block *>::iterator link;
+	} Block;
+
+	int read_source(kdu_core::kdu_byte *buf, int num_bytes);
+	int read_prefetched(kdu_core::kdu_byte *buf, int num_bytes);
+	void set_pos(kdu_core::kdu_long offset);
+	Block *lookup(kdu_core::kdu_long index);
+	Block *fetch(kdu_core::kdu_long index);
+	void insert(Block *block);
+	void free_blocks();
+
+	VipsSource *source;
+	VipsArea *stats = NULL;
+	std::vector<VipsKakaduRange> *ranges = NULL;
+	std::string shared_key;
+
+	/* Prefetched ranges, indexed by offset, with their data.
+	 */
+	std::map<kdu_core::kdu_long,
+		std::pair<kdu_core::kdu_long, const kdu_core::kdu_byte *>>
+		prefetched;
+
+	/* Zero for no cache.
+	 */
+	int block_size;
+
+	/* Our read position, and the position of source, or -1 if we don't
+	 * know.
+	 */
+	kdu_core::kdu_long position = 0;
+	kdu_core::kdu_long source_position = -1;
+
+	/* The block a sequential read would fetch next, and the number of blocks
+	 * to read on the next miss.
+	 */
+	kdu_core::kdu_long next_block = 0;
+	int readahead = 1;
+
+	/* New blocks start on the cold list, and move to the hot list when
+	 * they are hit.
+	 */
+	std::unordered_map<kdu_core::kdu_long, Block *> blocks;
+	std::list<Block *> cold;
+	std::list<Block *> hot;
+	int max_blocks;
+	int max_hot_blocks;
+
+	/* The block we last read from.
+	 */
+	Block *current = NULL;
+};
+
+/* A VipsTarget as a Kakadu output object. This keeps the reference
+ * alive while it's alive.
+ *
+ * Writes are combined in a large buffer. Rewrites (used by kakadu for TLM
+ * and PLT markers, and for box lengths) which land in the buffer are just
+ * memcpy()s, earlier positions are patched in the target with a seek.
+ *
+ * With no VipsTarget, we write to a growable memory area instead, and the
+ * caller can take ownership of it with steal().
+ */
+class VipsKakaduTarget : public kdu_core::kdu_compressed_target {
+public:
+	VipsKakaduTarget();
+	~VipsKakaduTarget();
+
+	bool exists() 
+	{ 
+		return target != NULL || to_memory; 
+	}
+
+	bool operator!() 
+	{ 
+		return !exists(); 
+	}
+
+	bool open(VipsTarget *_target);
+
+	/* Write to memory, starting with a buffer of this size. Pick a size
+	 * close to the final output size to avoid reallocations.
+	 */
+	bool open_memory(kdu_core::kdu_long initial_size);
+
+	/* Take ownership of the memory we've written to. Free with g_free().
+	 */
+	void *steal(size_t *length);
+
+	/* The number of bytes written so far.
+	 */
+	kdu_core::kdu_long get_position()
+	{
+		return position;
+	}
+
+	/* Reserve disc space for the expected output size. This is only a hint
+	 * and doesn't change the file size.
+	 */
+	void preallocate(kdu_core::kdu_long length);
+
+	virtual int get_capabilities();
+	virtual bool start_rewrite(kdu_core::kdu_long backtrack);
+	virtual bool end_rewrite();
+	virtual bool write(const kdu_core::kdu_byte *buf, int num_bytes);
+
+	/* Write any buffered bytes to the target. Call this before 
+	 * vips_target_end().
+	 */
+	bool flush();
+
+	virtual bool close();
+
+	/* Count writes here. We don't keep a reference.
+	 */
+	void set_stats(VipsArea *_stats)
+	{
+		stats = _stats;
+	}
+
+private:
+	/* Expand the memory buffer geometrically.
+	 */
+	bool grow();
+
+	VipsTarget *target;
+
+	/* Set if we're writing to memory rather than to a target.
+	 */
+	bool to_memory = false;
+
+	/* The write-combining buffer, and the position in the target of the
+	 * first byte in the buffer.
+	 */
+	kdu_core::kdu_byte *buffer;
+	kdu_core::kdu_long buffer_size = 0;
+	kdu_core::kdu_long buffer_start = 0;
+	kdu_core::kdu_long buffer_length = 0;
+
+	/* Where the next write will go, relative to the start of the output.
+	 */
+	kdu_core::kdu_long position = 0;
+
+	kdu_core::kdu_long saved_position = 0;
+	bool in_rewrite = false;
+
+	VipsArea *stats = NULL;
+};
+
+/* Kakadu worker threads for one load or save, taken from a plugin-wide
+ * pool. The total number of worker threads is limited by a budget (set with
+ * the VIPS_KAKADU_THREADS environment variable), and is shared fairly
+ * between concurrent operations.
+ *
+ * get() can return NULL, meaning no worker threads are available and kakadu
+ * should run in the calling thread.
+ *
+ * Call finished() when kakadu is done with the threads, and they'll go back
+ * to the pool for reuse. Otherwise (eg. after an exception) they are shut
+ * down on delete.
+ *
+ * With numa set (and libnuma available), the calling thread and the worker
+ * threads are kept on the calling thread's NUMA node until delete.
+ */
+class VipsKakaduThreads {
+public:
+	VipsKakaduThreads(bool numa = false);
+	~VipsKakaduThreads();
+
+	kdu_core::kdu_thread_env *get()
+	{
+		return env;
+	}
+
+	/* The number of threads kakadu will run on, including the caller.
+	 */
+	int get_num_threads()
+	{
+		return env ? env->get_num_threads() : 1;
+	}
+
+	void finished(kdu_core::kdu_codestream codestream);
+
+private:
+	kdu_core::kdu_thread_env *env;
+	bool reuse = false;
+
+	/* The NUMA node we are bound to, or -1, and the caller's previous CPU
+	 * affinity.
+	 */
+	int node = -1;
+	void *affinity = NULL;
+};
+
+/* Decoded tiles for one load, up to a byte budget. Tiles are VipsBlob, so
+ * a reader can keep using a tile after it has been evicted. All methods are
+ * thread-safe.
+ *
+ * Eviction is segmented LRU, like the source block cache: new tiles are
+ * probationary, and move to the protected segment when they are hit again.
+ * A viewer sweeping across the image then can't flush tiles it keeps
+ * coming back to.
+ */
+class VipsKakaduTileCache {
+public:
+	VipsKakaduTileCache(size_t _max_bytes);
+	~VipsKakaduTileCache();
+
+	/* A new ref to a tile, or NULL.
+	 */
+	VipsBlob *get(int index);
+
+	/* Add a tile, taking a new ref.
+	 */
+	void put(int index, VipsBlob *tile);
+
+	size_t get_bytes();
+
+private:
+	typedef struct _Entry {
+		int index;
+		VipsBlob *tile;
+
+		/* Which list we're on, and where.
+		 */
+		bool hot;
+		std::list<struct _Entry *>::iterator link;
+	} Entry;
+
+	void remove(Entry *entry);
+	void trim();
+
+	GMutex lock;
+
+	size_t max_bytes;
+	size_t max_hot_bytes;
+	size_t bytes = 0;
+	size_t hot_bytes = 0;
+
+	std::unordered_map<int, Entry *> entries;
+	std::list<Entry *> cold;
+	std::list<Entry *> hot;
+};
+
+void vips_kakadu_threads_init(void);
+bool vips_kakadu_threads_busy(void);
+
+/* Tracing is enabled by setting VIPS_KAKADU_TRACE to a filename at startup.
+ */
+extern bool vips_kakadu_trace_enabled;
+
+void vips_kakadu_trace_init(void);
+void vips_kakadu_trace_record(const char *name, gint64 start, gint64 stop,
+	const VipsRect *area);
+
+/* Exported, so servers can write a trace without exiting.
+ */
+extern "C" {
+int vips_kakadu_trace_dump(const char *filename);
+}
+
+/* A timed span, recorded from construction to destruction. With tracing
+ * disabled, this is just a test of a global.
+ *
+ * name must be a string constant, and area (if set) must outlive the span.
+ */
+class VipsKakaduSpan {
+public:
+	VipsKakaduSpan(const char *_name, const VipsRect *_area = NULL)
+	{
+		if (vips_kakadu_trace_enabled) {
+			name = _name;
+			area = _area;
+			start = g_get_monotonic_time();
+		}
+	}
+
+	~VipsKakaduSpan()
+	{
+		end();
+	}
+
+	/* End the span early.
+	 */
+	void end()
+	{
+		if (start) {
+			vips_kakadu_trace_record(name, start, g_get_monotonic_time(),
+				area);
+			start = 0;
+		}
+	}
+
+private:
+	const char *name;
+	const VipsRect *area;
+	gint64 start = 0;
+};
+
 extern kdu_core::kdu_message_formatter vips_foreign_kakadu_error_handler;
 extern kdu_core::kdu_message_formatter vips_foreign_kakadu_warn_handler;
@@ -0,0 +1,371 @@
+/* write a deepzoom pyramid from the resolution levels of a jpeg2000 image
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib/gstdio.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+typedef struct _VipsKakaduDzsave {
+	VipsOperation parent_instance;
+
+	/* Read from here, write name.dzi and name_files.
+	 */
+	char *filename;
+	char *output;
+
+	int tile_size;
+	int overlap;
+
+	/* Save tiles with this suffix, and perhaps options, eg. ".jpg[Q=85]".
+	 */
+	char *suffix;
+
+	/* The basename we write to, the full size image, the number of
+	 * kakaduload pages, and the number of deepzoom levels.
+	 */
+	char *name;
+	int width;
+	int height;
+	int n_pages;
+	int n_levels;
+
+	/* Set if any level fails.
+	 */
+	int failed;
+} VipsKakaduDzsave;
+
+typedef VipsOperationClass VipsKakaduDzsaveClass;
+
+G_DEFINE_TYPE(VipsKakaduDzsave, vips_kakadudzsave, VIPS_TYPE_OPERATION);
+
+static void
+vips_kakadudzsave_dispose(GObject *gobject)
+{
+	VipsKakaduDzsave *dzsave = (VipsKakaduDzsave *) gobject;
+
+	VIPS_FREE(dzsave->name);
+
+	G_OBJECT_CLASS(vips_kakadudzsave_parent_class)->dispose(gobject);
+}
+
+/* The image for a deepzoom level. Each level is half the size of the one
+ * above, rounding up, and the top level is the full image.
+ *
+ * Levels the codestream holds are decoded directly from the matching
+ * resolution. Levels below the smallest page are shrunk from that, but
+ * they are tiny.
+ */
+static VipsImage *
+vips_kakadudzsave_level_image(VipsKakaduDzsave *dzsave, int level)
+{
+	int shrink = dzsave->n_levels - 1 - level;
+	int page = VIPS_MIN(shrink, dzsave->n_pages - 1);
+	int width = VIPS_ROUND_UP(dzsave->width, 1 << shrink) >> shrink;
+	int height = VIPS_ROUND_UP(dzsave->height, 1 << shrink) >> shrink;
+
+	VipsImage *in;
+	if (vips_kakaduload(dzsave->filename, &in, "page", page, NULL))
+		return NULL;
+
+	if (page < shrink) {
+		VipsImage *x;
+
+		if (vips_resize(in, &x, 1.0 / (1 << (shrink - page)), NULL)) {
+			g_object_unref(in);
+			return NULL;
+		}
+		g_object_unref(in);
+		in = x;
+	}
+
+	// the codestream can round differently if the image doesn't start
+	// at the canvas origin
+	VipsImage *out;
+	if (vips_embed(in, &out, 0, 0, width, height,
+		"extend", VIPS_EXTEND_COPY,
+		NULL))
+		out = NULL;
+	g_object_unref(in);
+
+	return out;
+}
+
+static int
+vips_kakadudzsave_level_tiles(VipsKakaduDzsave *dzsave, int level,
+	VipsImage *image)
+{
+	g_autofree char *dirname = g_strdup_printf("%s_files%s%d",
+		dzsave->name, G_DIR_SEPARATOR_S, level);
+	if (g_mkdir_with_parents(dirname, 0777)) {
+		vips_error_system(errno, "kakadudzsave",
+			_("unable to create directory %s"), dirname);
+		return -1;
+	}
+
+	VipsRect bounds = { 0, 0, image->Xsize, image->Ysize };
+	int tiles_across = VIPS_ROUND_UP(image->Xsize, dzsave->tile_size) /
+		dzsave->tile_size;
+	int tiles_down = VIPS_ROUND_UP(image->Ysize, dzsave->tile_size) /
+		dzsave->tile_size;
+
+	for (int y = 0; y < tiles_down; y++)
+		for (int x = 0; x < tiles_across; x++) {
+			// tiles have an overlap on every edge except the image edge
+			VipsRect tile = {
+				x * dzsave->tile_size - dzsave->overlap,
+				y * dzsave->tile_size - dzsave->overlap,
+				dzsave->tile_size + 2 * dzsave->overlap,
+				dzsave->tile_size + 2 * dzsave->overlap
+			};
+			vips_rect_intersectrect(&tile, &bounds, &tile);
+
+			g_autofree char *filename = g_strdup_printf("%s%s%d_%d%s",
+				dirname, G_DIR_SEPARATOR_S, x, y, dzsave->suffix);
+
+			VipsImage *t;
+			if (vips_crop(image, &t,
+				tile.left, tile.top, tile.width, tile.height, NULL))
+				return -1;
+			int result = vips_image_write_to_file(t, filename, NULL);
+			g_object_unref(t);
+			if (result)
+				return -1;
+		}
+
+	return 0;
+}
+
+static void
+vips_kakadudzsave_level(gpointer data, gpointer user_data)
+{
+	VipsKakaduDzsave *dzsave = (VipsKakaduDzsave *) user_data;
+	int level = GPOINTER_TO_INT(data) - 1;
+
+	if (g_atomic_int_get(&dzsave->failed))
+		return;
+
+	VipsKakaduSpan span("dzsave level");
+	VipsImage *image;
+	if (!(image = vips_kakadudzsave_level_image(dzsave, level)) ||
+		vips_kakadudzsave_level_tiles(dzsave, level, image))
+		g_atomic_int_set(&dzsave->failed, 1);
+	VIPS_UNREF(image);
+
+#ifdef DEBUG
+	printf("vips_kakadudzsave_level: level %d done\n", level);
+#endif /*DEBUG*/
+}
+
+static int
+vips_kakadudzsave_write_dzi(VipsKakaduDzsave *dzsave)
+{
+	g_autofree char *filename = g_strdup_printf("%s.dzi", dzsave->name);
+
+	// just the format, not any save options
+	g_autofree char *format = g_strdup(dzsave->suffix + 1);
+	char *p;
+	if ((p = strchr(format, '[')))
+		*p = '\0';
+
+	g_autofree char *dzi = g_strdup_printf(
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+		"  Format=\"%s\"\n"
+		"  Overlap=\"%d\"\n"
+		"  TileSize=\"%d\"\n"
+		"  >\n"
+		"  <Size\n"
+		"    Height=\"%d\"\n"
+		"    Width=\"%d\"\n"
+		"  />\n"
+		"</Image>\n",
+		format, dzsave->overlap, dzsave->tile_size,
+		dzsave->height, dzsave->width);
+
+	GError *error = NULL;
+	if (!g_file_set_contents(filename, dzi, -1, &error)) {
+		vips_g_error(&error);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+vips_kakadudzsave_build(VipsObject *object)
+{
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(object);
+	VipsKakaduDzsave *dzsave = (VipsKakaduDzsave *) object;
+
+#ifdef DEBUG
+	printf("vips_kakadudzsave_build:\n");
+#endif /*DEBUG*/
+
+	if (VIPS_OBJECT_CLASS(vips_kakadudzsave_parent_class)->build(object))
+		return -1;
+
+	if (dzsave->overlap >= dzsave->tile_size) {
+		vips_error(klass->nickname,
+			"%s", _("overlap must be less than tile size"));
+		return -1;
+	}
+	if (dzsave->suffix[0] != '.') {
+		vips_error(klass->nickname,
+			"%s", _("suffix must start with '.'"));
+		return -1;
+	}
+
+	// "x.dzi" and "x" both mean write x.dzi and x_files
+	dzsave->name = g_strdup(dzsave->output);
+	if (vips_iscasepostfix(dzsave->name, ".dzi"))
+		dzsave->name[strlen(dzsave->name) - 4] = '\0';
+
+	VipsImage *image;
+	if (vips_kakaduload(dzsave->filename, &image, NULL))
+		return -1;
+	dzsave->width = image->Xsize;
+	dzsave->height = image->Ysize;
+	dzsave->n_pages = vips_image_get_n_pages(image);
+	g_object_unref(image);
+
+	// down to 1x1
+	int size = VIPS_MAX(dzsave->width, dzsave->height);
+	dzsave->n_levels = 1;
+	while ((1 << (dzsave->n_levels - 1)) < size)
+		dzsave->n_levels += 1;
+
+	if (vips_kakadudzsave_write_dzi(dzsave))
+		return -1;
+
+	// each level is an independent decode, so run them in parallel,
+	// largest first
+	GThreadPool *pool;
+	if (!(pool = g_thread_pool_new(vips_kakadudzsave_level, dzsave,
+		vips_concurrency_get(), FALSE, NULL)))
+		return -1;
+	for (int level = dzsave->n_levels - 1; level >= 0; level--)
+		g_thread_pool_push(pool, GINT_TO_POINTER(level + 1), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (dzsave->failed)
+		return -1;
+
+	return 0;
+}
+
+static void
+vips_kakadudzsave_class_init(VipsKakaduDzsaveClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	VipsObjectClass *object_class = (VipsObjectClass *) klass;
+	VipsOperationClass *operation_class = VIPS_OPERATION_CLASS(klass);
+
+	gobject_class->dispose = vips_kakadudzsave_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "kakadudzsave";
+	object_class->description =
+		_("save JPEG2000 image as a deepzoom pyramid");
+	object_class->build = vips_kakadudzsave_build;
+
+	// this writes files, so it can't be cached
+	operation_class->flags = VIPS_OPERATION_NOCACHE;
+
+	VIPS_ARG_STRING(klass, "filename", 1,
+		_("Filename"),
+		_("Filename to load from"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduDzsave, filename),
+		NULL);
+
+	VIPS_ARG_STRING(klass, "output", 2,
+		_("Output"),
+		_("Basename to save to"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduDzsave, output),
+		NULL);
+
+	VIPS_ARG_INT(klass, "tile_size", 11,
+		_("Tile size"),
+		_("Tile size in pixels"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduDzsave, tile_size),
+		1, 8192, 254);
+
+	VIPS_ARG_INT(klass, "overlap", 12,
+		_("Overlap"),
+		_("Tile overlap in pixels"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduDzsave, overlap),
+		0, 8192, 1);
+
+	VIPS_ARG_STRING(klass, "suffix", 13,
+		_("Suffix"),
+		_("Filename suffix for tiles"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduDzsave, suffix),
+		".jpeg");
+}
+
+static void
+vips_kakadudzsave_init(VipsKakaduDzsave *dzsave)
+{
+	dzsave->tile_size = 254;
+	dzsave->overlap = 1;
+	dzsave->suffix = g_strdup(".jpeg");
+}
+
+/**
+ * vips_kakadudzsave:
+ * @filename: file to read from
+ * @output: basename to write to
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @tile_size: %gint, tile size in pixels
+ * * @overlap: %gint, tile overlap in pixels
+ * * @suffix: %gchararray, filename suffix for tiles
+ *
+ * Write a JPEG2000 image as a deepzoom pyramid, as vips_dzsave() with the
+ * default deepzoom layout. @output.dzi and the directory @output_files are
+ * written.
+ *
+ * Rather than shrinking the full resolution image for each level, each
+ * level is decoded directly from the matching resolution in the
+ * codestream, and the levels are decoded in parallel. Levels below the
+ * smallest resolution vips_kakaduload() offers are shrunk from that.
+ * Pixels will be slightly different from vips_dzsave(), since the
+ * wavelet lowpass filter is not a box filter.
+ *
+ * Set @suffix to the tile format, plus any save options, for example
+ * `".jpg[Q=90]"` or `".png"`.
+ *
+ * See also: vips_dzsave(), vips_kakaduload().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_kakadudzsave(const char *filename, const char *output, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, output);
+	result = vips_call_split("kakadudzsave", ap, filename, output);
+	va_end(ap);
+
+	return result;
+}
@@ -16,80 +16,416 @@
 #include "kakadu.h"
 
 #include <kdu_region_decompressor.h>
+#include <kdu_stripe_decompressor.h>
 
 using namespace kdu_supp; // includes the core namespace
 
-/* A VipsSource as a Kakadu input object. This keeps the reference
- * alive while it's alive.
+/* The block cache in VipsKakaduSource holds this many bytes, and a quarter
+ * of that can be hot blocks.
  */
-class VipsKakaduSource : public kdu_compressed_source {
-public:
-	VipsKakaduSource(VipsSource *_source)
-	{
-		source = _source;
-		g_object_ref(source);
+#define SOURCE_CACHE_SIZE (4 * 1024 * 1024)
+
+/* Read at most this many blocks ahead, and at most this many bytes in a
+ * single fetch.
+ */
+#define MAX_READAHEAD (16)
+#define MAX_READAHEAD_BYTES (SOURCE_CACHE_SIZE / 2)
+
+/* The default size of the decoded tile cache for each load.
+ */
+#define DEFAULT_CACHE_BYTES (100 * 1024 * 1024)
+
+/* With cache_threshold set, keep at most this many closed tiles loaded.
+ */
+#define UNLOADING_THRESHOLD (16)
+
+/* Images with more than this many pixels get this cache_threshold, unless
+ * the user sets one.
+ */
+#define LARGE_IMAGE_THRESHOLD (256 * 1024 * 1024)
+#define DEFAULT_CACHE_THRESHOLD (64 * 1024 * 1024)
+
+/* With auto_layers, decode enough quality layers for this fraction of the
+ * uncompressed size of the page.
+ */
+#define AUTO_LAYERS_FRACTION (1.0 / 3.0)
+
+/* Images with up to this many pixels are decoded in a single pass.
+ */
+#define DEFAULT_SMALL_THRESHOLD (2048 * 2048)
+
+VipsKakaduSource::VipsKakaduSource(VipsSource *_source, int _block_size)
+{
+	source = _source;
+	g_object_ref(source);
+
+	block_size = _block_size;
+	if (block_size > 0) {
+		max_blocks = VIPS_MAX(4, SOURCE_CACHE_SIZE / block_size);
+		max_hot_blocks = max_blocks / 4;
 	}
+}
 
-	~VipsKakaduSource()
-	{
+VipsKakaduSource::~VipsKakaduSource()
+{
 #ifdef DEBUG_READ
-		printf("~VipsKakaduSource:\n");
+	printf("~VipsKakaduSource:\n");
 #endif /*DEBUG_READ*/
 
-		VIPS_UNREF(source);
-	}
+	free_blocks();
+	VIPS_UNREF(source);
+}
 
-	virtual int get_capabilities() 
-	{
-		return KDU_SOURCE_CAP_SEQUENTIAL | KDU_SOURCE_CAP_SEEKABLE; 
+void
+VipsKakaduSource::free_blocks()
+{
+	for (auto &item : blocks) {
+		g_free(item.second->data);
+		delete item.second;
 	}
 
-	virtual bool seek(kdu_long offset)
-	{
+	blocks.clear();
+	cold.clear();
+	hot.clear();
+	current = NULL;
+}
+
+int
+VipsKakaduSource::get_capabilities()
+{
+	return KDU_SOURCE_CAP_SEQUENTIAL | KDU_SOURCE_CAP_SEEKABLE; 
+}
+
+bool
+VipsKakaduSource::seek(kdu_long offset)
+{
 #ifdef DEBUG_READ
-		printf("VipsKakaduSource: seek(%lld)\n", offset);
+	printf("VipsKakaduSource: seek(%lld)\n", offset);
 #endif /*DEBUG_READ*/
 
+	vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_SEEKS, 1);
+	set_pos(offset);
+
+	return true;
+}
+
+void
+VipsKakaduSource::set_pos(kdu_long offset)
+{
+	if (block_size > 0)
+		position = offset;
+	else
 		// kakadu assumes this will always succeed
 		(void) vips_source_seek(source, offset, SEEK_SET);
+}
+
+kdu_long
+VipsKakaduSource::get_pos()
+{
+	if (block_size > 0)
+		return position;
+	else
+		return vips_source_seek(source, 0, SEEK_CUR);
+}
+
+/* Find a cached block, and move it to the front of the hot list.
+ */
+VipsKakaduSource::Block *
+VipsKakaduSource::lookup(kdu_long index)
+{
+	auto item = blocks.find(index);
+	if (item == blocks.end())
+		return NULL;
+
+	Block *block = item->second;
+	if (block->hot)
+		hot.erase(block->link);
+	else
+		cold.erase(block->link);
+	hot.push_front(block);
+	block->link = hot.begin();
+	block->hot = true;
+
+	// too many hot blocks? demote the oldest
+	if ((int) hot.size() > max_hot_blocks) {
+		Block *oldest = hot.back();
+
+		hot.pop_back();
+		cold.push_front(oldest);
+		oldest->link = cold.begin();
+		oldest->hot = false;
+	}
+
+	return block;
+}
+
+/* Add a new block to the front of the cold list, evicting the oldest cold
+ * block if we're full.
+ */
+void
+VipsKakaduSource::insert(Block *block)
+{
+	if ((int) blocks.size() >= max_blocks) {
+		std::list<Block *> &victims = cold.empty() ? hot : cold;
+		Block *oldest = victims.back();
+
+		victims.pop_back();
+		blocks.erase(oldest->index);
+		if (oldest == current)
+			current = NULL;
+		g_free(oldest->data);
+		delete oldest;
+	}
+
+	cold.push_front(block);
+	block->link = cold.begin();
+	block->hot = false;
+	blocks[block->index] = block;
+}
+
+/* Read the block at index, plus some readahead, from the source, and
+ * return the block at index. NULL for EOF or error.
+ */
+VipsKakaduSource::Block *
+VipsKakaduSource::fetch(kdu_long index)
+{
+	// another load of this file may have read the block already
+	kdu_byte *shared_data;
+	int shared_length;
+	if (!shared_key.empty() &&
+		(shared_data = vips_kakadu_block_cache_get(shared_key.c_str(), 
+			index, &shared_length))) {
+		Block *block = new Block();
+		block->index = index;
+		block->data = shared_data;
+		block->length = shared_length;
+		insert(block);
+
+		next_block = index + 1;
+
+		return block;
+	}
 
-		return true;
+	// readahead grows while misses are sequential
+	if (index == next_block)
+		readahead = VIPS_MIN(readahead * 2, MAX_READAHEAD);
+	else
+		readahead = 1;
+
+	/* The whole fetch must fit on the cold list, or inserting the last
+	 * blocks would evict the first one, which we return. Large blocks can
+	 * also make the fetch too large to malloc, so cap the bytes too.
+	 */
+	int max_readahead = VIPS_MIN(readahead, max_blocks - max_hot_blocks);
+	max_readahead = VIPS_MIN(max_readahead, 
+		VIPS_MAX(1, MAX_READAHEAD_BYTES / block_size));
+
+	// don't read blocks we already have
+	int n_blocks;
+	for (n_blocks = 1; n_blocks < max_readahead; n_blocks++)
+		if (blocks.count(index + n_blocks))
+			break;
+
+	kdu_long offset = index * block_size;
+	if (source_position != offset) {
+		if (vips_source_seek(source, offset, SEEK_SET) < 0) {
+			source_position = -1;
+			return NULL;
+		}
+		source_position = offset;
 	}
 
-	virtual kdu_long get_pos()
-	{
-		 return vips_source_seek(source, 0, SEEK_CUR);
+	// several source reads can be needed to fill the request
+	size_t size = (size_t) n_blocks * block_size;
+	kdu_byte *data = (kdu_byte *) g_malloc(size);
+	size_t length = 0;
+	while (length < size) {
+		gint64 bytes_read = vips_source_read(source, 
+			data + length, size - length);
+
+#ifdef DEBUG_READ
+		printf("VipsKakaduSource: source read(%zd) = %ld\n", 
+			size - length, bytes_read);
+#endif /*DEBUG_READ*/
+
+		vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_READS, 1);
+		if (bytes_read <= 0)
+			break;
+		vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_BYTES_READ, 
+			bytes_read);
+
+		length += bytes_read;
+	}
+	source_position += length;
+
+	Block *first = NULL;
+	for (int i = 0; i < n_blocks; i++) {
+		size_t start = (size_t) i * block_size;
+		if (start >= length)
+			break;
+
+		Block *block = new Block();
+		block->index = index + i;
+		block->length = VIPS_MIN((size_t) block_size, length - start);
+		block->data = (kdu_byte *) g_malloc(block->length);
+		memcpy(block->data, data + start, block->length);
+		insert(block);
+
+		if (!shared_key.empty())
+			vips_kakadu_block_cache_put(shared_key.c_str(), 
+				block->index, block->data, block->length);
+
+		if (i == 0)
+			first = block;
 	}
+	g_free(data);
 
-	virtual int read(kdu_byte *buf, int num_bytes)
-	{
+	next_block = index + n_blocks;
+
+	return first;
+}
+
+void
+VipsKakaduSource::prefetch(kdu_long offset, kdu_long length,
+	const kdu_byte *data)
+{
+	if (length > 0)
+		prefetched[offset] = std::make_pair(length, data);
+}
+
+int
+VipsKakaduSource::read_source(kdu_byte *buf, int num_bytes)
+{
+	if (block_size == 0) {
 		gint64 bytes_read = vips_source_read(source, buf, num_bytes);
 
 #ifdef DEBUG_READ
 		printf("VipsKakaduSource: read(%d) = %ld\n", num_bytes, bytes_read);
 #endif /*DEBUG_READ*/
 
+		vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_READS, 1);
+		if (bytes_read > 0)
+			vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_BYTES_READ, 
+				bytes_read);
+
 		return bytes_read;
 	}
 
-	void rewind()
-	{
-		vips_source_rewind(source);
+	int bytes_read = 0;
+	while (bytes_read < num_bytes) {
+		kdu_long index = position / block_size;
+		int offset = position % block_size;
+
+		// many small reads in the same block count as a single hit
+		Block *block;
+		if (current &&
+			current->index == index)
+			block = current;
+		else if (!(block = lookup(index)) &&
+			!(block = fetch(index)))
+			break;
+		current = block;
+
+		// a short block is the end of the file
+		if (offset >= block->length)
+			break;
+
+		int n = VIPS_MIN(num_bytes - bytes_read, block->length - offset);
+		memcpy(buf + bytes_read, block->data + offset, n);
+		bytes_read += n;
+		position += n;
 	}
 
-	virtual bool close()
-	{
 #ifdef DEBUG_READ
-		printf("VipsKakaduSource: close()\n");
+	printf("VipsKakaduSource: read(%d) = %d\n", num_bytes, bytes_read);
 #endif /*DEBUG_READ*/
 
-		VIPS_UNREF(source);
-		return true;
+	return bytes_read;
+}
+
+/* Copy from prefetched ranges where we can, and read the gaps between them
+ * from the source.
+ */
+int
+VipsKakaduSource::read_prefetched(kdu_byte *buf, int num_bytes)
+{
+	kdu_long start = get_pos();
+
+	int bytes_read = 0;
+	while (bytes_read < num_bytes) {
+		kdu_long pos = start + bytes_read;
+		int n = num_bytes - bytes_read;
+
+		// the first range after pos, and the range before that, which
+		// might hold pos
+		auto next = prefetched.upper_bound(pos);
+		auto item = next == prefetched.begin() ?
+			prefetched.end() : std::prev(next);
+		if (item != prefetched.end() &&
+			pos < item->first + item->second.first) {
+			kdu_long offset = pos - item->first;
+
+			n = VIPS_MIN(n, item->second.first - offset);
+			memcpy(buf + bytes_read, item->second.second + offset, n);
+		}
+		else {
+			// read from the source up to the next prefetched range
+			if (next != prefetched.end())
+				n = VIPS_MIN(n, next->first - pos);
+
+			set_pos(pos);
+			if ((n = read_source(buf + bytes_read, n)) <= 0)
+				break;
+		}
+
+		bytes_read += n;
 	}
 
-private:
-	VipsSource *source;
-};
+	set_pos(start + bytes_read);
+
+	return bytes_read;
+}
+
+int
+VipsKakaduSource::read(kdu_byte *buf, int num_bytes)
+{
+	kdu_long start = ranges ? get_pos() : 0;
+
+	int bytes_read = prefetched.empty() ?
+		read_source(buf, num_bytes) :
+		read_prefetched(buf, num_bytes);
+
+	if (ranges &&
+		bytes_read > 0) {
+		if (!ranges->empty() &&
+			ranges->back().first + ranges->back().second == start)
+			ranges->back().second += bytes_read;
+		else
+			ranges->push_back(VipsKakaduRange(start, bytes_read));
+	}
+
+	return bytes_read;
+}
+
+void
+VipsKakaduSource::rewind()
+{
+	vips_source_rewind(source);
+	position = 0;
+	source_position = 0;
+}
+
+bool
+VipsKakaduSource::close()
+{
+#ifdef DEBUG_READ
+	printf("VipsKakaduSource: close()\n");
+#endif /*DEBUG_READ*/
+
+	free_blocks();
+	VIPS_UNREF(source);
+	return true;
+}
 
 static VipsForeignKakaduError vips_foreign_kakadu_error;
 static VipsForeignKakaduWarn vips_foreign_kakadu_warn;
@@ -115,6 +451,78 @@ typedef struct _VipsForeignLoadKakadu {
 	int page;
 	int shrink;
 
+	/* Keep decode threads on one NUMA node.
+	 */
+	gboolean numa;
+
+	/* Read and cache the source in blocks of this size.
+	 */
+	int block_size;
+
+	/* Share compressed blocks with other loads of the same file.
+	 */
+	gboolean shared_cache;
+
+	/* Let kakadu unload parsed codestream state past this many bytes.
+	 */
+	int cache_threshold;
+
+	/* Decode images with up to this many pixels in one pass, skipping
+	 * the tile pipeline.
+	 */
+	int small_threshold;
+
+	/* Convert to sRGB during decode.
+	 */
+	gboolean srgb;
+
+	/* Load palette images as the index, with the palette as metadata.
+	 */
+	gboolean indexed;
+
+	/* Trade decode speed against precision.
+	 */
+	VipsKakaduPreset preset;
+
+	/* Decode this many quality layers, 0 for all, or pick from the page
+	 * size.
+	 */
+	int layers;
+	gboolean auto_layers;
+
+	/* Byte ranges we've already read (eg. from kakaduplan), and the
+	 * data in them.
+	 */
+	VipsArrayDouble *ranges;
+	VipsBlob *range_data;
+
+	/* Decode up to this many neighbouring tiles in the background after
+	 * each cache miss.
+	 */
+	int prefetch;
+
+	/* Prefetch runs in this pool, and decodes into the tile cache.
+	 * Pending holds the indexes of queued tiles.
+	 */
+	GThreadPool *prefetch_pool;
+	GMutex prefetch_lock;
+	GHashTable *prefetch_pending;
+	int prefetch_cancel;
+
+	/* Decoded tiles, up to cache_bytes.
+	 */
+	guint64 cache_bytes;
+	VipsKakaduTileCache *tile_cache;
+
+	/* Identifies this file and decode in the cross-process tile cache, or
+	 * NULL if we're not using it.
+	 */
+	char *shared_tiles_key;
+
+	/* Performance counters, shared with the "kakadu-stats" metadata item.
+	 */
+	VipsArea *stats;
+
 	/* The kakadu input objects.
 	 */
 	jp2_family_src *input;
@@ -138,6 +546,10 @@ typedef struct _VipsForeignLoadKakadu {
 	kdu_channel_mapping *channel_mapping;
 	kdu_region_decompressor *region_decompressor;
 
+	/* Held while we use region_decompressor.
+	 */
+	GMutex decode_lock;
+
 	/* kakadu colour mapping.
 	 */
 	int cmp;
@@ -149,11 +561,19 @@ typedef struct _VipsForeignLoadKakadu {
 	 */
 	int width;
 	int height;
+	kdu_coords origin;
 	int tile_width;
 	int tile_height;
+	int tiles_across;
+	int tiles_down;
 	int bands;
 	int bits_per_sample;
 	int n_pages;
+	int n_layers;
+	int decode_layers;
+	gboolean convert;
+	gboolean use_index;
+	VipsImage *palette_image;
 	VipsBandFormat format;
 	VipsInterpretation interpretation;
 	double xres;
@@ -181,6 +601,16 @@ vips_foreign_load_kakadu_dispose(GObject *gobject)
 	printf("vips_foreign_load_kakadu_dispose:\n");
 #endif /*DEBUG*/
 
+	// drop queued prefetches and wait for any running one
+	if (kakadu->prefetch_pool) {
+		g_atomic_int_set(&kakadu->prefetch_cancel, 1);
+		g_thread_pool_free(kakadu->prefetch_pool, TRUE, TRUE);
+		kakadu->prefetch_pool = NULL;
+	}
+	VIPS_FREEF(g_hash_table_destroy, kakadu->prefetch_pending);
+	DELETE(kakadu->tile_cache);
+	VIPS_FREE(kakadu->shared_tiles_key);
+
 	DELETE(kakadu->channel_mapping);
 	DELETE(kakadu->region_decompressor);
 	DELETE(kakadu->input);
@@ -189,11 +619,75 @@ vips_foreign_load_kakadu_dispose(GObject *gobject)
 
 	VIPS_FREE(kakadu->channel_offsets);
 
+	VIPS_UNREF(kakadu->palette_image);
 	VIPS_UNREF(kakadu->vips_source);
 
+	if (kakadu->stats) {
+		vips_area_unref(kakadu->stats);
+		kakadu->stats = NULL;
+	}
+
 	G_OBJECT_CLASS(vips_foreign_load_kakadu_parent_class)->dispose(gobject);
 }
 
+static void
+vips_foreign_load_kakadu_finalize(GObject *gobject)
+{
+	VipsForeignLoadKakadu *kakadu = (VipsForeignLoadKakadu *) gobject;
+
+	g_mutex_clear(&kakadu->prefetch_lock);
+	g_mutex_clear(&kakadu->decode_lock);
+
+	G_OBJECT_CLASS(vips_foreign_load_kakadu_parent_class)->finalize(gobject);
+}
+
+/* Serve reads from the prefetched ranges, if we have them. range_data is
+ * the data for each range, one after the other.
+ */
+static int
+vips_foreign_load_kakadu_prefetch(VipsForeignLoadKakadu *kakadu)
+{
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(kakadu);
+
+	if (!kakadu->ranges &&
+		!kakadu->range_data)
+		return 0;
+	if (!kakadu->ranges ||
+		!kakadu->range_data) {
+		vips_error(klass->nickname,
+			"%s", _("set both ranges and range_data"));
+		return -1;
+	}
+
+	int n;
+	double *ranges = vips_array_double_get(kakadu->ranges, &n);
+	size_t length;
+	const kdu_byte *data = (const kdu_byte *)
+		vips_blob_get(kakadu->range_data, &length);
+
+	size_t total = 0;
+	gboolean valid = n % 2 == 0;
+	for (int i = 0; valid && i < n; i += 2) {
+		valid = ranges[i] >= 0 && ranges[i + 1] >= 0;
+		total += ranges[i + 1];
+	}
+	if (!valid ||
+		total != length) {
+		vips_error(klass->nickname,
+			"%s", _("ranges do not match range_data"));
+		return -1;
+	}
+
+	size_t offset = 0;
+	for (int i = 0; i < n; i += 2) {
+		kakadu->kakadu_source->prefetch(ranges[i], ranges[i + 1],
+			data + offset);
+		offset += ranges[i + 1];
+	}
+
+	return 0;
+}
+
 static int
 vips_foreign_load_kakadu_build(VipsObject *object)
 {
@@ -203,7 +697,19 @@ vips_foreign_load_kakadu_build(VipsObject *object)
 	printf("vips_foreign_load_kakadu_build:\n");
 #endif /*DEBUG*/
 
-	kakadu->kakadu_source = new VipsKakaduSource(kakadu->vips_source);
+	kakadu->stats = vips_kakadu_stats_new();
+	kakadu->kakadu_source = 
+		new VipsKakaduSource(kakadu->vips_source, kakadu->block_size);
+	kakadu->kakadu_source->set_stats(kakadu->stats);
+	if (vips_foreign_load_kakadu_prefetch(kakadu))
+		return -1;
+
+	// sources which aren't files can't be shared
+	g_autofree char *key = NULL;
+	if (kakadu->shared_cache &&
+		kakadu->block_size > 0 &&
+		(key = vips_kakadu_block_cache_key(kakadu->vips_source)))
+		kakadu->kakadu_source->set_shared(key);
 
 	// read bytes and image data into these
 	kakadu->input = new jp2_family_src();
@@ -284,15 +790,36 @@ vips_foreign_load_kakadu_set_header(VipsForeignLoadKakadu *kakadu,
 	out->Xoffset = dims.access_pos()->x;
 	out->Yoffset = dims.access_pos()->y;
 
+	// after conversion, the profile no longer describes the pixels
 	int num_bytes;
 	const kdu_byte *data = kakadu->colour.get_icc_profile(&num_bytes);
-	if (data && num_bytes > 0)
+	if (!kakadu->convert &&
+		data && 
+		num_bytes > 0)
 		vips_image_set_blob_copy(out, VIPS_META_ICC_NAME, data, num_bytes);
 
 	vips_image_set_int(out, VIPS_META_N_PAGES, kakadu->n_pages);
+	vips_image_set_int(out, "kakadu-layers", kakadu->decode_layers > 0 ?
+		VIPS_MIN(kakadu->decode_layers, kakadu->n_layers) : 
+		kakadu->n_layers);
 	vips_image_set_int(out, 
 			VIPS_META_BITS_PER_SAMPLE, kakadu->bits_per_sample);
 
+	// share our counters, so they update as the image is computed
+	GValue value = G_VALUE_INIT;
+	g_value_init(&value, VIPS_TYPE_ARRAY_DOUBLE);
+	g_value_set_boxed(&value, kakadu->stats);
+	vips_image_set(out, "kakadu-stats", &value);
+	g_value_unset(&value);
+
+	// a LUT for vips_maplut()
+	if (kakadu->palette_image) {
+		g_value_init(&value, VIPS_TYPE_IMAGE);
+		g_value_set_object(&value, kakadu->palette_image);
+		vips_image_set(out, "kakadu-palette", &value);
+		g_value_unset(&value);
+	}
+
 	return 0;
 }
 
@@ -467,6 +994,51 @@ vips_foreign_load_kakadu_get_resolution(VipsForeignLoadKakadu *kakadu)
 	kakadu->xres = kakadu->yres * kakadu->resolution.get_aspect_ratio();
 }
 
+/* kakadusave (and kdu_compress) record the size of each quality layer in a
+ * codestream comment. Pick the fewest layers which give us a fraction of
+ * the uncompressed size of a reduced page, or 0 for all layers.
+ */
+static int
+vips_foreign_load_kakadu_auto_layers(VipsForeignLoadKakadu *kakadu)
+{
+	const char *prefix = "Kdu-Layer-Info:";
+	double target_bytes = AUTO_LAYERS_FRACTION * 
+		kakadu->width * kakadu->height * 
+		kakadu->bands * kakadu->bits_per_sample / 8.0;
+
+	// the detail in later layers is only invisible at reduced sizes
+	if (kakadu->page == 0)
+		return 0;
+
+	kdu_codestream_comment comment;
+	while ((comment = kakadu->codestream.get_comment(comment)).exists()) {
+		const char *text = comment.get_text();
+		const char *p;
+
+		if (!text ||
+			!vips_isprefix(prefix, text) ||
+			!(p = strchr(text, '\n')))
+			continue;
+
+		// a line per layer of "slope, cumulative bytes"
+		double slope;
+		double bytes;
+		int n;
+		for (int layer = 1; 
+			sscanf(p, "%lf, %lf%n", &slope, &bytes, &n) == 2; 
+			layer++) {
+			if (bytes >= target_bytes)
+				return layer;
+
+			p += n;
+		}
+
+		break;
+	}
+
+	return 0;
+}
+
 static int
 vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 {
@@ -479,6 +1051,8 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 	printf("vips_foreign_load_kakadu_header:\n");
 #endif /*DEBUG*/
 
+	VipsKakaduSpan span("header");
+
 	try {
 		kakadu->kakadu_source->rewind();
 
@@ -537,7 +1111,9 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 		// and we need a codestream to get bitdepth, width, height, etc.
 		kdu_compressed_source *compressed_source = 
 			kakadu->codestream_source.open_stream();
+		VipsKakaduSpan create_span("codestream create");
 		kakadu->codestream.create(compressed_source);
+		create_span.end();
 
 		vips_foreign_load_kakadu_set_error_behaviour(kakadu);
 
@@ -569,10 +1145,32 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 		kakadu->width = dims.size.x;
 		kakadu->height = dims.size.y;
 
+		// a persistent codestream keeps parsed state for every tile we
+		// visit, and a single pass over a huge image would keep the
+		// whole codestream ... let kakadu unload it once it passes the
+		// threshold
+		if (!vips_object_argument_isset(VIPS_OBJECT(kakadu), 
+				"cache_threshold") &&
+			(guint64) kakadu->width * kakadu->height > 
+				LARGE_IMAGE_THRESHOLD)
+			kakadu->cache_threshold = DEFAULT_CACHE_THRESHOLD;
+		if (kakadu->cache_threshold > 0) {
+			kakadu->codestream.augment_cache_threshold(
+				kakadu->cache_threshold);
+			kakadu->codestream.set_tile_unloading_threshold(
+				UNLOADING_THRESHOLD);
+		}
+
+		// the image can start anywhere on the canvas, eg. after
+		// kakaduextract
+		kakadu->origin = dims.pos;
+
 		// get the tile size (used to size the libvips tile cache)
 		kakadu->codestream.get_tile_partition(dims);
-		kakadu->tile_width = dims.size.x;
-		kakadu->tile_height = dims.size.y;
+		kakadu->tile_width = VIPS_MIN(dims.size.x,
+			VIPS_MIN(kakadu->width, VIPS_KAKADU_MAX_CACHE_TILE_SIZE));
+		kakadu->tile_height = VIPS_MIN(dims.size.y,
+			VIPS_MIN(kakadu->height, VIPS_KAKADU_MAX_CACHE_TILE_SIZE));
 
 		kakadu->bands = kakadu->codestream.get_num_components();
 
@@ -649,6 +1247,24 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 			break;
 		}
 
+		// palette images have a single index component ... either return
+		// that, with the palette as metadata, or expand it to a band per
+		// colour
+		kakadu->use_index = FALSE;
+		if (kakadu->palette.get_num_luts() > 0) {
+			if (kakadu->indexed) {
+				kakadu->use_index = TRUE;
+				kakadu->interpretation = VIPS_INTERPRETATION_MULTIBAND;
+				expected_colour_bands = 1;
+				if (!(kakadu->palette_image = 
+					vips_foreign_load_kakadu_palette(kakadu)))
+					return -1;
+			}
+			else
+				kakadu->bands = VIPS_MAX(kakadu->bands, 
+					kakadu->channels.get_num_colours());
+		}
+
 		// can be more with alpha etc.
 		if (expected_colour_bands > kakadu->bands) {
 			vips_error(klass->nickname,
@@ -656,6 +1272,48 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 			return -1;
 		}
 
+		// kakadu can convert most colour spaces to sRGB (or sRGB 
+		// greyscale) as part of decode, saving a later icc_transform
+		kakadu->convert = FALSE;
+		if (kakadu->srgb &&
+			!kakadu->use_index) {
+			int colours = kakadu->channels.get_num_colours();
+			bool use_wide_gamut = false;
+			bool prefer_fast_approximations = true;
+			jp2_colour_converter converter;
+
+			if ((colours == 1 || 
+					colours == 3) &&
+				converter.init(kakadu->colour, 
+					use_wide_gamut, prefer_fast_approximations)) {
+				// already sRGB, or close enough
+				kakadu->convert = converter.is_non_trivial();
+
+				if (colours == 1)
+					kakadu->interpretation = 
+						kakadu->format == VIPS_FORMAT_USHORT ?
+							VIPS_INTERPRETATION_GREY16 : 
+							VIPS_INTERPRETATION_B_W;
+				else
+					kakadu->interpretation = 
+						kakadu->format == VIPS_FORMAT_USHORT ?
+							VIPS_INTERPRETATION_RGB16 : 
+							VIPS_INTERPRETATION_sRGB;
+			}
+			else
+				g_warning("%s", _("unable to convert colour space to sRGB"));
+		}
+
+		// the number of quality layers, and how many we'll decode
+		kakadu->n_layers = 1;
+		kakadu->codestream.access_siz()->access_cluster(COD_params)->
+			get(Clayers, 0, 0, kakadu->n_layers);
+		kakadu->decode_layers = kakadu->layers;
+		if (kakadu->decode_layers == 0 &&
+			kakadu->auto_layers)
+			kakadu->decode_layers = 
+				vips_foreign_load_kakadu_auto_layers(kakadu);
+
 		vips_foreign_load_kakadu_get_resolution(kakadu);
 
 #ifdef DEBUG
@@ -676,44 +1334,117 @@ vips_foreign_load_kakadu_header(VipsForeignLoad *load)
 	return 0;
 }
 
-static int
-vips_foreign_load_kakadu_generate(VipsRegion *out,
-	void *seq, void *a, void *b, gboolean *stop)
+/* The palette as a one-line image, one column per entry and one band per
+ * colour, ready for vips_maplut().
+ */
+static VipsImage *
+vips_foreign_load_kakadu_palette(VipsForeignLoadKakadu *kakadu)
 {
-	VipsForeignLoad *load = (VipsForeignLoad *) a;
-	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(load);
-	VipsForeignLoadKakadu *kakadu = (VipsForeignLoadKakadu *) load;
-	VipsRect *r = &out->valid;
+	int entries = kakadu->palette.get_num_entries();
+	int luts = kakadu->palette.get_num_luts();
+
+	int max_bits = 0;
+	for (int i = 0; i < luts; i++)
+		max_bits = VIPS_MAX(max_bits, kakadu->palette.get_bit_depth(i));
+	VipsBandFormat format = max_bits <= 8 ? 
+		VIPS_FORMAT_UCHAR : VIPS_FORMAT_USHORT;
+
+	size_t size = (size_t) entries * luts * vips_format_sizeof(format);
+	void *data = g_malloc(size);
+	std::vector<float> lut(entries);
+	for (int b = 0; b < luts; b++) {
+		int max_value = (1 << kakadu->palette.get_bit_depth(b)) - 1;
+
+		// kakadu normalises entries to -0.5 .. +0.5
+		kakadu->palette.get_lut(b, lut.data());
+		for (int i = 0; i < entries; i++) {
+			int value = VIPS_RINT((lut[i] + 0.5) * max_value);
+
+			value = VIPS_CLIP(0, value, max_value);
+			if (format == VIPS_FORMAT_UCHAR)
+				((guint8 *) data)[i * luts + b] = value;
+			else
+				((guint16 *) data)[i * luts + b] = value;
+		}
+	}
+
+	VipsImage *image = vips_image_new_from_memory_copy(data, size,
+		entries, 1, luts, format);
+	g_free(data);
+	if (image &&
+		luts == 3)
+		image->Type = format == VIPS_FORMAT_UCHAR ?
+			VIPS_INTERPRETATION_sRGB : VIPS_INTERPRETATION_RGB16;
+
+	return image;
+}
+
+/* The area of a cache tile, clipped to the image.
+ */
+static void
+vips_foreign_load_kakadu_tile_rect(VipsForeignLoadKakadu *kakadu, int index,
+	VipsRect *r)
+{
+	VipsRect image = { 0, 0, kakadu->width, kakadu->height };
+
+	r->left = (index % kakadu->tiles_across) * kakadu->tile_width;
+	r->top = (index / kakadu->tiles_across) * kakadu->tile_height;
+	r->width = kakadu->tile_width;
+	r->height = kakadu->tile_height;
+	vips_rect_intersectrect(r, &image, r);
+}
+
+/* Decode an area to a new blob, or fetch it from the cross-process tile
+ * cache. There's a single region decompressor, so call with decode_lock
+ * held.
+ */
+static VipsBlob *
+vips_foreign_load_kakadu_decode(VipsForeignLoadKakadu *kakadu, VipsRect *r)
+{
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(kakadu);
 
 #ifdef DEBUG_VERBOSE
-	printf("vips_foreign_load_kakadu_generate: "
+	printf("vips_foreign_load_kakadu_decode: "
 		   "left = %d, top = %d, width = %d, height = %d\n",
 		r->left, r->top, r->width, r->height);
 #endif /*DEBUG_VERBOSE*/
 
+	// we're only called on tile cache misses
+	VipsKakaduSpan span("tilecache miss", r);
+
+	size_t line_size = (size_t) r->width * kakadu->bands *
+		vips_format_sizeof(kakadu->format);
+	size_t length = line_size * r->height;
+
+	// another process may have decoded this area already
+	g_autofree char *key = NULL;
+	VipsBlob *shared;
+	if (kakadu->shared_tiles_key) {
+		key = g_strdup_printf("%s region %d %d %d %d",
+			kakadu->shared_tiles_key,
+			r->left, r->top, r->width, r->height);
+		if ((shared = vips_kakadu_shared_tiles_get(key, length)))
+			return shared;
+	}
+
+	kdu_byte *buffer = (kdu_byte *) g_malloc(length);
+	VipsBlob *tile = vips_blob_new((VipsCallbackFn) vips_area_free_cb,
+		buffer, length);
+
 	try {
-		// 16 seems like a sensible limit ... we want to avoid overcommitting
-		// thread resources if we can
-		int n_threads = VIPS_MIN(16, vips_concurrency_get());
-
-		// we can't reuse this between libvips workers, unfortunately, since
-		// region_decompressor needs the calling thread to always be the same,
-		// which libvips can't guarantee
-		//
-		// we have to create and destroy thread_env for each tile
-		kdu_thread_env env;
-		env.create();
-		for (int i = 0; i < n_threads; i++)
-			if (!env.add_thread()) {
-				vips_error(klass->nickname, "%s", "thread create failed");
-				return -1;
-			}
+		// region_decompressor needs the calling thread to own the thread
+		// group, and libvips can call us from any worker, so we borrow a
+		// group from the plugin-wide pool for each tile
+		VipsKakaduThreads threads(kakadu->numa);
+		vips_kakadu_stats_max(kakadu->stats, VIPS_KAKADU_STATS_THREADS,
+			threads.get_num_threads());
 
 		// coordinates in tile_position are always in terms of the full size
 		// image, so we must scale up with the reduction factor
 		int scale = 1;
 		kdu_dims tile_position;
-		tile_position.pos = kdu_coords(r->left * scale, r->top * scale);
+		tile_position.pos = kakadu->origin +
+			kdu_coords(r->left * scale, r->top * scale);
 		tile_position.size = kdu_coords(r->width * scale, r->height * scale);
 		kdu_coords expand_numerator(1, 1);
 		kdu_coords expand_denominator(1, 1);
@@ -721,18 +1452,18 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 		// not used, since we supply a channel mapping
 		int single_component = 0;
 
-		// decode all quality layers
-		int max_layers = 1000;
+		// decode all quality layers, unless we've picked a number
+		int max_layers = kakadu->decode_layers > 0 ? 
+			kakadu->decode_layers : 1000;
 
-		// aim for speed rather than ultimate precision
-		bool precise = false;
+		// by default, aim for speed rather than ultimate precision
+		bool precise = kakadu->preset == VIPS_KAKADU_PRESET_PRECISE;
+		bool fastest = kakadu->preset == VIPS_KAKADU_PRESET_FAST;
 
 		// specify params in terms of the output image
 		kdu_component_access_mode mode = KDU_WANT_OUTPUT_COMPONENTS;
 
-		// aim for a fast path
-		bool fastest = true;
-
+		VipsKakaduSpan start_span("decompressor start", r);
 		if (!kakadu->region_decompressor->start(
 				kakadu->codestream,
 				kakadu->channel_mapping,
@@ -745,17 +1476,19 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 				precise,
 				mode,
 				fastest,
-				&env)) {
+				threads.get())) {
 			vips_error(klass->nickname, "%s", "start failed");
-			return -1;
+			vips_area_unref(VIPS_AREA(tile));
+			return NULL;
 		}
+		start_span.end();
 
 		kdu_dims incomplete_region = tile_position;
 		kdu_dims new_region;
 		int top = r->top;
 		do {
 			// we have to step data down the output area while we generate it
-			kdu_byte *data = (kdu_byte *) VIPS_REGION_ADDR(out, r->left, top);
+			kdu_byte *data = buffer + (top - r->top) * line_size;
 
 			kdu_coords buffer_origin = kdu_coords(0, 0);
 			int row_gap = 0;
@@ -765,9 +1498,18 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 			// we always want the whole tile
 			int max_region_pixels = 1000000000;
 
+			// samples are scaled to fill the output type, except palette
+			// indexes
+			int precision_bits;
+
+			VipsKakaduSpan process_span("decompressor process", r);
+			gint64 start = g_get_monotonic_time();
+
 			bool result;
 			switch (kakadu->format) {
 			case VIPS_FORMAT_UCHAR:
+				precision_bits = kakadu->use_index ? 
+					kakadu->bits_per_sample : 8;
 				result = kakadu->region_decompressor->process(
 						data,
 						kakadu->channel_offsets,
@@ -777,10 +1519,13 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 						suggested_increment,
 						max_region_pixels,
 						incomplete_region,
-						new_region);
+						new_region,
+						precision_bits);
 				break;
 
 			case VIPS_FORMAT_USHORT:
+				precision_bits = kakadu->use_index ? 
+					kakadu->bits_per_sample : 16;
 				result = kakadu->region_decompressor->process(
 						(kdu_uint16*) data,
 						kakadu->channel_offsets,
@@ -790,7 +1535,8 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 						suggested_increment,
 						max_region_pixels,
 						incomplete_region,
-						new_region);
+						new_region,
+						precision_bits);
 				break;
 
 			case VIPS_FORMAT_FLOAT:
@@ -808,9 +1554,14 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 
 			default:
 				vips_error(klass->nickname, "%s", "unimplemented format");
-				return -1;
+				vips_area_unref(VIPS_AREA(tile));
+				return NULL;
 			}
 
+			vips_kakadu_stats_add(kakadu->stats,
+				VIPS_KAKADU_STATS_PROCESS_USEC,
+				g_get_monotonic_time() - start);
+
 			if (!result)
 				break;
 
@@ -818,15 +1569,312 @@ vips_foreign_load_kakadu_generate(VipsRegion *out,
 			top += new_region.size.y;
 		} while (incomplete_region.size.y > 0);
 
+		VipsKakaduSpan finish_span("decompressor finish", r);
 		if (!kakadu->region_decompressor->finish()) {
 			vips_error(klass->nickname, "%s", "finish failed");
-			return -1;
+			vips_area_unref(VIPS_AREA(tile));
+			return NULL;
+		}
+
+		vips_kakadu_stats_add(kakadu->stats, VIPS_KAKADU_STATS_TILES, 1);
+		vips_kakadu_stats_memory(kakadu->stats, kakadu->codestream);
+
+		threads.finished(kakadu->codestream);
+	}
+	catch (kdu_exception e) {
+		vips_area_unref(VIPS_AREA(tile));
+		return NULL;
+	}
+
+	if (key)
+		vips_kakadu_shared_tiles_put(key, tile);
+
+	return tile;
+}
+
+/* TRUE if we can decode the whole image with a stripe decompressor. That
+ * knows nothing of jp2 channel mappings, palettes or colour conversion, so
+ * every band must come straight from an 8-bit output component of the same
+ * size as the image.
+ */
+static gboolean
+vips_foreign_load_kakadu_is_small(VipsForeignLoadKakadu *kakadu)
+{
+	if ((guint64) kakadu->width * kakadu->height > 
+			(guint64) kakadu->small_threshold ||
+		kakadu->format != VIPS_FORMAT_UCHAR ||
+		kakadu->palette.get_num_luts() > 0 ||
+		kakadu->convert ||
+		kakadu->channel_mapping->num_channels != kakadu->bands)
+		return FALSE;
+
+	try {
+		// the stripe decompressor makes output components, so ask for
+		// those ... region_decompressor sets its own restrictions on 
+		// start, so this won't affect the tile path
+		kakadu->codestream.apply_input_restrictions(0, 0,
+			kakadu->page, kakadu->decode_layers, NULL, 
+			KDU_WANT_OUTPUT_COMPONENTS);
+
+		if (kakadu->codestream.get_num_components(true) != kakadu->bands)
+			return FALSE;
+
+		for (int i = 0; i < kakadu->bands; i++) {
+			kdu_dims dims;
+
+			kakadu->codestream.get_dims(i, dims, true);
+			if (kakadu->channel_mapping->source_components[i] != i ||
+				kakadu->codestream.get_bit_depth(i, true) != 8 ||
+				dims.size.x != kakadu->width ||
+				dims.size.y != kakadu->height)
+				return FALSE;
 		}
 	}
+	catch (kdu_exception e) {
+		// the tile path will report the error, if there is one
+		vips_error_clear();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Decode the whole image into a memory image in a single stripe
+ * decompressor pass, or fetch it from the cross-process tile cache.
+ */
+static int
+vips_foreign_load_kakadu_decode_whole(VipsForeignLoadKakadu *kakadu,
+	VipsImage *out)
+{
+	VipsRect r = { 0, 0, kakadu->width, kakadu->height };
+	kdu_byte *buffer = (kdu_byte *) VIPS_IMAGE_ADDR(out, 0, 0);
+	size_t length = VIPS_IMAGE_SIZEOF_IMAGE(out);
+
+#ifdef DEBUG
+	printf("vips_foreign_load_kakadu_decode_whole:\n");
+#endif /*DEBUG*/
+
+	VipsKakaduSpan span("whole image", &r);
+
+	// the stripe decompressor can round differently from the region
+	// decompressor, so don't share pixels with a cache tile covering the
+	// whole image
+	g_autofree char *key = NULL;
+	VipsBlob *shared;
+	if (kakadu->shared_tiles_key) {
+		key = g_strdup_printf("%s whole %d %d %d %d",
+			kakadu->shared_tiles_key,
+			r.left, r.top, r.width, r.height);
+		if ((shared = vips_kakadu_shared_tiles_get(key, length))) {
+			memcpy(buffer, VIPS_AREA(shared)->data, length);
+			vips_area_unref(VIPS_AREA(shared));
+			return 0;
+		}
+	}
+
+	try {
+		// we decode on the calling thread, with helpers from the pool
+		VipsKakaduThreads threads(kakadu->numa);
+		vips_kakadu_stats_max(kakadu->stats, VIPS_KAKADU_STATS_THREADS,
+			threads.get_num_threads());
+
+		// by default, aim for speed rather than ultimate precision
+		bool force_precise = kakadu->preset == VIPS_KAKADU_PRESET_PRECISE;
+		bool want_fastest = kakadu->preset == VIPS_KAKADU_PRESET_FAST;
+
+		kdu_stripe_decompressor decompressor;
+		VipsKakaduSpan start_span("decompressor start", &r);
+		decompressor.start(kakadu->codestream,
+			force_precise,
+			want_fastest,
+			threads.get());
+		start_span.end();
+
+		// one stripe for the whole image, with bands interleaved
+		std::vector<int> stripe_heights(kakadu->bands, kakadu->height);
+
+		VipsKakaduSpan process_span("decompressor process", &r);
+		gint64 start = g_get_monotonic_time();
+		decompressor.pull_stripe(buffer, stripe_heights.data());
+		vips_kakadu_stats_add(kakadu->stats,
+			VIPS_KAKADU_STATS_PROCESS_USEC,
+			g_get_monotonic_time() - start);
+		process_span.end();
+
+		VipsKakaduSpan finish_span("decompressor finish", &r);
+		decompressor.finish();
+		finish_span.end();
+
+		vips_kakadu_stats_add(kakadu->stats, VIPS_KAKADU_STATS_TILES, 1);
+		vips_kakadu_stats_memory(kakadu->stats, kakadu->codestream);
+
+		threads.finished(kakadu->codestream);
+	}
 	catch (kdu_exception e) {
 		return -1;
 	}
 
+	if (key) {
+		VipsBlob *tile = vips_blob_copy(buffer, length);
+
+		vips_kakadu_shared_tiles_put(key, tile);
+		vips_area_unref(VIPS_AREA(tile));
+	}
+
+	return 0;
+}
+
+static void vips_foreign_load_kakadu_prefetch_neighbours(
+	VipsForeignLoadKakadu *kakadu, int index);
+
+/* A new ref to a cache tile, decoding it on a miss. NULL on error.
+ */
+static VipsBlob *
+vips_foreign_load_kakadu_get_tile(VipsForeignLoadKakadu *kakadu, int index,
+	gboolean prefetch)
+{
+	VipsBlob *tile;
+
+	if ((tile = kakadu->tile_cache->get(index)))
+		return tile;
+
+	g_mutex_lock(&kakadu->decode_lock);
+
+	// another thread may have decoded this tile while we waited
+	if (!(tile = kakadu->tile_cache->get(index))) {
+		VipsRect rect;
+
+		vips_foreign_load_kakadu_tile_rect(kakadu, index, &rect);
+		if ((tile = vips_foreign_load_kakadu_decode(kakadu, &rect)))
+			kakadu->tile_cache->put(index, tile);
+
+		// only misses we were asked for start more prefetches
+		if (tile &&
+			!prefetch &&
+			kakadu->prefetch_pool)
+			vips_foreign_load_kakadu_prefetch_neighbours(kakadu, index);
+	}
+
+	g_mutex_unlock(&kakadu->decode_lock);
+
+	return tile;
+}
+
+/* Decode a tile into the cache in the background.
+ */
+static void
+vips_foreign_load_kakadu_prefetch_tile(gpointer data, gpointer user_data)
+{
+	VipsForeignLoadKakadu *kakadu = (VipsForeignLoadKakadu *) user_data;
+	int index = GPOINTER_TO_INT(data) - 1;
+
+	// skip the tile if we're shutting down, or if kakadu has no spare
+	// threads
+	if (!g_atomic_int_get(&kakadu->prefetch_cancel) &&
+		!vips_kakadu_threads_busy()) {
+		VipsKakaduSpan span("prefetch");
+		VipsBlob *tile;
+
+		// failures will be seen again if the tile is ever needed
+		if ((tile = vips_foreign_load_kakadu_get_tile(kakadu, index, TRUE)))
+			vips_area_unref(VIPS_AREA(tile));
+	}
+
+	g_mutex_lock(&kakadu->prefetch_lock);
+	g_hash_table_remove(kakadu->prefetch_pending, data);
+	g_mutex_unlock(&kakadu->prefetch_lock);
+}
+
+/* Queue the neighbours of a tile we've just decoded, edges first, then
+ * corners, up to the prefetch budget.
+ */
+static void
+vips_foreign_load_kakadu_prefetch_neighbours(VipsForeignLoadKakadu *kakadu,
+	int index)
+{
+	static const int offsets[][2] = {
+		{ -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 },
+		{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }
+	};
+
+	int x = index % kakadu->tiles_across;
+	int y = index / kakadu->tiles_across;
+
+	g_mutex_lock(&kakadu->prefetch_lock);
+
+	for (int i = 0; i < VIPS_NUMBER(offsets); i++) {
+		int nx = x + offsets[i][0];
+		int ny = y + offsets[i][1];
+
+		if (nx < 0 ||
+			nx >= kakadu->tiles_across ||
+			ny < 0 ||
+			ny >= kakadu->tiles_down)
+			continue;
+		if ((int) g_hash_table_size(kakadu->prefetch_pending) >=
+			kakadu->prefetch)
+			break;
+
+		// offset by one so index 0 isn't NULL
+		gpointer data = GINT_TO_POINTER(ny * kakadu->tiles_across + nx + 1);
+		if (!g_hash_table_contains(kakadu->prefetch_pending, data)) {
+			g_hash_table_add(kakadu->prefetch_pending, data);
+			g_thread_pool_push(kakadu->prefetch_pool, data, NULL);
+		}
+	}
+
+	g_mutex_unlock(&kakadu->prefetch_lock);
+}
+
+/* Copy from the cache tiles which touch the region, decoding any we don't
+ * have.
+ */
+static int
+vips_foreign_load_kakadu_generate(VipsRegion *out,
+	void *seq, void *a, void *b, gboolean *stop)
+{
+	VipsForeignLoadKakadu *kakadu = (VipsForeignLoadKakadu *) a;
+	VipsRect *r = &out->valid;
+	size_t pel_size = VIPS_IMAGE_SIZEOF_PEL(out->im);
+
+#ifdef DEBUG_VERBOSE
+	printf("vips_foreign_load_kakadu_generate: "
+		   "left = %d, top = %d, width = %d, height = %d\n",
+		r->left, r->top, r->width, r->height);
+#endif /*DEBUG_VERBOSE*/
+
+	int left = r->left / kakadu->tile_width;
+	int top = r->top / kakadu->tile_height;
+	int right = (VIPS_RECT_RIGHT(r) - 1) / kakadu->tile_width;
+	int bottom = (VIPS_RECT_BOTTOM(r) - 1) / kakadu->tile_height;
+
+	for (int y = top; y <= bottom; y++)
+		for (int x = left; x <= right; x++) {
+			int index = y * kakadu->tiles_across + x;
+
+			VipsBlob *tile;
+			if (!(tile = vips_foreign_load_kakadu_get_tile(kakadu, 
+				index, FALSE)))
+				return -1;
+
+			VipsRect rect;
+			vips_foreign_load_kakadu_tile_rect(kakadu, index, &rect);
+			VipsRect overlap;
+			vips_rect_intersectrect(&rect, r, &overlap);
+
+			size_t line_size = rect.width * pel_size;
+			kdu_byte *p = (kdu_byte *) VIPS_AREA(tile)->data +
+				(overlap.top - rect.top) * line_size +
+				(overlap.left - rect.left) * pel_size;
+			for (int i = 0; i < overlap.height; i++) {
+				memcpy(VIPS_REGION_ADDR(out, overlap.left, overlap.top + i),
+					p, overlap.width * pel_size);
+				p += line_size;
+			}
+
+			vips_area_unref(VIPS_AREA(tile));
+		}
+
 	return 0;
 }
 
@@ -841,56 +1889,99 @@ vips_foreign_load_kakadu_load(VipsForeignLoad *load)
 	printf("vips_foreign_load_kakadu_load:\n");
 #endif /*DEBUG*/
 
-	t[0] = vips_image_new();
-	if (vips_foreign_load_kakadu_set_header(kakadu, t[0]))
-		return -1;
-
 	// grab all channels
 	// FIXME this won't work well for multispectral data
 	kakadu->channel_mapping = new kdu_channel_mapping();
-	kakadu->channel_mapping->configure(
-			kakadu->colour,
-			kakadu->channels,
-			0,						// int codestream_idx
-			kakadu->palette,
-			kakadu->dimensions);
+	if (kakadu->use_index)
+		// the raw codestream components, so no palette lookup
+		kakadu->channel_mapping->configure(kakadu->codestream);
+	else
+		kakadu->channel_mapping->configure(
+				kakadu->colour,
+				kakadu->channels,
+				0,						// int codestream_idx
+				kakadu->palette,
+				kakadu->dimensions);
+
+	// configure() can set up a converter to sRGB by itself, but we only
+	// want one if the user asked and it does something, since we attach
+	// the profile to unconverted pixels
+	if (!kakadu->convert)
+		DELETE(kakadu->channel_mapping->colour_converter);
+	else if (!kakadu->channel_mapping->colour_converter) {
+		bool use_wide_gamut = false;
+		bool prefer_fast_approximations = true;
+
+		kakadu->channel_mapping->colour_converter = 
+			new jp2_colour_converter();
+		kakadu->channel_mapping->colour_converter->init(kakadu->colour,
+			use_wide_gamut, prefer_fast_approximations);
+	}
 
 	kakadu->channel_offsets = VIPS_ARRAY(NULL, kakadu->bands, int);
 	for (int i = 0; i < kakadu->bands; i++) 
 		kakadu->channel_offsets[i] = i;
 
-	kakadu->region_decompressor = new kdu_region_decompressor();
+	// we can share decoded pixels with other processes
+	g_autofree char *file_key = NULL;
+	if (vips_kakadu_shared_tiles_enabled() &&
+		(file_key = vips_kakadu_block_cache_key(kakadu->vips_source)))
+		kakadu->shared_tiles_key = g_strdup_printf(
+			"%s page %d layers %d preset %s%s%s",
+			file_key, kakadu->page, kakadu->decode_layers,
+			vips_enum_nick(VIPS_TYPE_KAKADU_PRESET, kakadu->preset),
+			kakadu->convert ? " srgb" : "",
+			kakadu->use_index ? " index" : "");
+
+	// thumbnails and other small images are dominated by per-tile
+	// overhead, so decode them in one go
+	if (vips_foreign_load_kakadu_is_small(kakadu)) {
+		t[0] = vips_image_new_memory();
+		if (vips_foreign_load_kakadu_set_header(kakadu, t[0]) ||
+			vips_image_write_prepare(t[0]) ||
+			vips_foreign_load_kakadu_decode_whole(kakadu, t[0]) ||
+			vips_image_write(t[0], load->real))
+			return -1;
 
-	if (vips_image_generate(t[0],
-		NULL, vips_foreign_load_kakadu_generate, NULL,
-		kakadu, NULL))
+		return 0;
+	}
+
+	t[0] = vips_image_new();
+	if (vips_foreign_load_kakadu_set_header(kakadu, t[0]))
 		return -1;
 
+	kakadu->region_decompressor = new kdu_region_decompressor();
+
 	// FIXME .. maybe scale up the real tile size to get c. 512x512?
 	// on this PC: 
 	// 256x256 == 5.4s
 	// 512x512 == 2.2s
 	// larger tiles fail to decode properly for some reason I don't 
 	// understand
-	int tiles_across = VIPS_ROUND_UP(kakadu->width, kakadu->tile_width) / 
+	kakadu->tiles_across = 
+		VIPS_ROUND_UP(kakadu->width, kakadu->tile_width) / 
 		kakadu->tile_width;
+	kakadu->tiles_down = 
+		VIPS_ROUND_UP(kakadu->height, kakadu->tile_height) / 
+		kakadu->tile_height;
+
+	// decoded tiles are shared by all threads
+	kakadu->tile_cache = new VipsKakaduTileCache(kakadu->cache_bytes);
+
+	// a single background thread is enough, since only one thread can
+	// decode at once
+	if (kakadu->prefetch > 0) {
+		kakadu->prefetch_pending = g_hash_table_new(NULL, NULL);
+		if (!(kakadu->prefetch_pool = g_thread_pool_new(
+			vips_foreign_load_kakadu_prefetch_tile, kakadu, 
+			1, FALSE, NULL)))
+			return -1;
+	}
 
-	/* Copy to out, adding a cache. Enough tiles for two complete
-	 * rows, plus 50%.
-	 *
-	 * FIXME ... set the tile size from the source image
-	 *
-	 * FIXME ... have the decompressor per thread and allow threaded cache
-	 * access
-	 */
-	if (vips_tilecache(t[0], &t[1],
-		"tile_width", kakadu->tile_width,
-		"tile_height", kakadu->tile_height,
-		"max_tiles", 3 * tiles_across,
-		NULL))
-		return -1;
-
-	if (vips_image_write(t[1], load->real))
+	if (vips_image_generate(t[0],
+		NULL, vips_foreign_load_kakadu_generate, NULL,
+		kakadu, NULL) ||
+		vips_image_write(t[0], load->real))
 		return -1;
 
 	return 0;
@@ -921,6 +2012,7 @@ vips_foreign_load_kakadu_class_init(VipsForeignLoadKakaduClass *klass)
 	VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) klass;
 
 	gobject_class->dispose = vips_foreign_load_kakadu_dispose;
+	gobject_class->finalize = vips_foreign_load_kakadu_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -941,11 +2033,115 @@ vips_foreign_load_kakadu_class_init(VipsForeignLoadKakaduClass *klass)
 		VIPS_ARGUMENT_OPTIONAL_INPUT,
 		G_STRUCT_OFFSET(VipsForeignLoadKakadu, page),
 		0, 100000, 0);
+
+	VIPS_ARG_BOOL(klass, "numa", 21,
+		_("NUMA"),
+		_("Keep decode threads on one NUMA node"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, numa),
+		FALSE);
+
+	VIPS_ARG_INT(klass, "block_size", 22,
+		_("Block size"),
+		_("Read and cache the source in blocks of this many bytes"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, block_size),
+		0, 16 * 1024 * 1024, VIPS_KAKADU_BLOCK_SIZE);
+
+	VIPS_ARG_BOXED(klass, "ranges", 23,
+		_("Ranges"),
+		_("Offset and length of each prefetched byte range"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, ranges),
+		VIPS_TYPE_ARRAY_DOUBLE);
+
+	VIPS_ARG_BOXED(klass, "range_data", 24,
+		_("Range data"),
+		_("Bytes of each prefetched range, one after the other"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, range_data),
+		VIPS_TYPE_BLOB);
+
+	VIPS_ARG_INT(klass, "prefetch", 25,
+		_("Prefetch"),
+		_("Decode up to this many neighbouring tiles in the background"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, prefetch),
+		0, 64, 0);
+
+	VIPS_ARG_UINT64(klass, "cache_bytes", 26,
+		_("Cache bytes"),
+		_("Keep up to this many bytes of decoded tiles"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, cache_bytes),
+		0, G_MAXINT64, DEFAULT_CACHE_BYTES);
+
+	VIPS_ARG_BOOL(klass, "shared_cache", 27,
+		_("Shared cache"),
+		_("Share compressed data with other loads of the same file"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, shared_cache),
+		FALSE);
+
+	VIPS_ARG_INT(klass, "cache_threshold", 28,
+		_("Cache threshold"),
+		_("Unload parsed codestream state past this many bytes"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, cache_threshold),
+		0, G_MAXINT, 0);
+
+	VIPS_ARG_INT(klass, "small_threshold", 29,
+		_("Small threshold"),
+		_("Decode images with up to this many pixels in a single pass"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, small_threshold),
+		0, G_MAXINT, DEFAULT_SMALL_THRESHOLD);
+
+	VIPS_ARG_BOOL(klass, "srgb", 30,
+		_("sRGB"),
+		_("Convert to sRGB during decode"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, srgb),
+		FALSE);
+
+	VIPS_ARG_BOOL(klass, "indexed", 31,
+		_("Indexed"),
+		_("Load palette images as indexes, with the palette as metadata"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, indexed),
+		FALSE);
+
+	VIPS_ARG_ENUM(klass, "preset", 32,
+		_("Preset"),
+		_("Trade decode speed against precision"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, preset),
+		VIPS_TYPE_KAKADU_PRESET, VIPS_KAKADU_PRESET_FAST);
+
+	VIPS_ARG_INT(klass, "layers", 33,
+		_("Layers"),
+		_("Number of quality layers to decode, 0 for all"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, layers),
+		0, 65535, 0);
+
+	VIPS_ARG_BOOL(klass, "auto_layers", 34,
+		_("Auto layers"),
+		_("Pick the number of quality layers from the page size"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignLoadKakadu, auto_layers),
+		FALSE);
 }
 
 static void
 vips_foreign_load_kakadu_init(VipsForeignLoadKakadu *kakadu)
 {
+	kakadu->block_size = VIPS_KAKADU_BLOCK_SIZE;
+	kakadu->cache_bytes = DEFAULT_CACHE_BYTES;
+	kakadu->small_threshold = DEFAULT_SMALL_THRESHOLD;
+	kakadu->preset = VIPS_KAKADU_PRESET_FAST;
+	g_mutex_init(&kakadu->prefetch_lock);
+	g_mutex_init(&kakadu->decode_lock);
 }
 
 typedef struct _VipsForeignLoadKakaduFile {
@@ -1188,6 +2384,20 @@ extern "C" {
  * Optional arguments:
  *
  * * @page: %gint, load this page
+ * * @numa: %gboolean, keep decode threads on one NUMA node
+ * * @block_size: %gint, read and cache the source in blocks of this size
+ * * @ranges: #VipsArrayDouble, prefetched byte ranges
+ * * @range_data: #VipsBlob, bytes of the prefetched ranges
+ * * @prefetch: %gint, decode up to this many neighbouring tiles
+ * * @cache_bytes: %guint64, keep up to this many bytes of decoded tiles
+ * * @shared_cache: %gboolean, share compressed data between loads
+ * * @cache_threshold: %gint, unload parsed codestream state past this size
+ * * @small_threshold: %gint, decode images up to this size in a single pass
+ * * @srgb: %gboolean, convert to sRGB during decode
+ * * @indexed: %gboolean, load palette images as indexes
+ * * @preset: #VipsKakaduPreset, trade decode speed against precision
+ * * @layers: %gint, number of quality layers to decode
+ * * @auto_layers: %gboolean, pick the number of layers from the page size
  * * @fail_on: #VipsFailOn, types of read error to fail on
  *
  * Read a JPEG2000 image. The loader supports 8, 16 and 32-bit int pixel
@@ -1200,6 +2410,103 @@ extern "C" {
  * image and higher-numbered pages are x2 reductions. Use the metadata item
  * "n-pages" to find the number of pyramid layers.
  *
+ * Set @numa to keep the decode for each tile on the NUMA node of the
+ * calling thread, so pixel buffers and kakadu's working memory stay local.
+ * This needs the plugin to be built with libnuma.
+ *
+ * The source is read in blocks of @block_size bytes (64kb by default), and
+ * a small cache of blocks is kept. This coalesces the many tiny reads that
+ * kakadu makes, which helps a lot with slow sources, such as network
+ * filesystems. Set @block_size to 0 to pass every read straight to the
+ * source.
+ *
+ * Use vips_kakaduplan() to find the byte ranges a load will read, fetch
+ * them (eg. with a single multi-range request to an object store), and
+ * pass the offset and length of each range as @ranges and the bytes,
+ * one range after the other, as @range_data. Reads which fall in these
+ * ranges are then served from memory, and only reads outside them go to
+ * the source.
+ *
+ * Set @prefetch to decode tiles next to each tile we decode in the
+ * background, ready for viewers which pan around an image. Up to @prefetch
+ * tiles are queued at once, and they only decode while kakadu has spare
+ * threads. Queued tiles are dropped when the image is closed.
+ *
+ * Decoded tiles are kept in a cache of up to @cache_bytes bytes (100mb by
+ * default), shared by all threads. Tiles which are used more than once are
+ * protected from eviction by tiles which are only used once, so a sweep
+ * across the image won't flush tiles which keep being revisited. Set
+ * @cache_bytes to 0 to decode every tile on every use.
+ *
+ * Set @shared_cache to keep the compressed blocks read from a file in a
+ * cache shared by all loads of that file in this process. Compressed data
+ * is many times smaller than decoded pixels, so the same memory covers far
+ * more of the image, and a tile can be decoded again without touching the
+ * file. Set the size of the shared cache in MB with the environment
+ * variable `VIPS_KAKADU_SHARED_CACHE` (256 by default). Files are matched
+ * by name, size and modification time.
+ *
+ * Set the environment variable `VIPS_KAKADU_TILE_CACHE` to a directory
+ * (ideally on tmpfs, eg. `/dev/shm/kakadu-tiles`) to share decoded tiles
+ * between processes, for example prefork server workers. Tiles are looked
+ * up by file, page, area and layers before they are decoded, and written
+ * there after. Set the size in MB with `VIPS_KAKADU_TILE_CACHE_MB` (1024 by
+ * default). The least recently used tiles are removed when it's full.
+ *
+ * Random tile access needs kakadu to keep the codestream open, and by
+ * default it keeps the parsed packets and code-blocks of every tile it has
+ * visited, so memory grows as a viewer pans around a huge image. Set
+ * @cache_threshold to a size in bytes to let kakadu unload parsed state
+ * beyond that, and to unload closed tiles. Images of more than 256
+ * megapixels default to 64MB, so a single pass over a huge image stays
+ * bounded. Set it to 0 to keep everything. The peak codestream memory is
+ * the last item in "kakadu-stats", so you can check that long-lived loads
+ * stay bounded.
+ *
+ * Images with no more than @small_threshold pixels (4 megapixels by
+ * default) are decoded in a single multi-threaded pass straight into
+ * memory, skipping the tile cache and the per-tile decoder setup. This
+ * makes thumbnails of reduced pages much quicker. Images with palettes,
+ * subsampled components or more than 8 bits always use the tile path. Set
+ * @small_threshold to 0 to always decode on demand.
+ *
+ * Set @srgb to convert colour to sRGB (or sRGB greyscale) as part of
+ * decode, rather than with a separate vips_icc_transform() pass. This
+ * handles embedded ICC profiles, and spaces like sYCC and YCbCr which
+ * otherwise load as #VIPS_INTERPRETATION_MULTIBAND. Converted images have
+ * no ICC profile attached. Images kakadu can't convert, such as CMYK, load
+ * unchanged with a warning.
+ *
+ * Palette images are normally expanded to a band per colour. Set @indexed
+ * to load them as the index component instead, with the palette attached
+ * as the metadata item "kakadu-palette", an image with one column per
+ * entry and one band per colour. This is much smaller, and
+ * vips_maplut() with the palette will expand it later, if you need to.
+ * @indexed has no effect on images without a palette.
+ *
+ * Use @preset to trade decode speed against precision. The default, 
+ * "fast", lets kakadu use 16-bit arithmetic and its quickest
+ * transforms, which is plenty for 8-bit output. "balanced" avoids the
+ * approximations kakadu makes to go fastest, and "precise" always works
+ * in 32-bit, which matters most for 16-bit and float images, or when
+ * pixels are used for measurement rather than display.
+ *
+ * Use @layers to decode only the first few quality layers, which is
+ * quicker, but lower quality. Set @auto_layers to pick the number of layers
+ * from the size of the page you load: kakadusave records the size of each
+ * layer in the file, and the loader decodes just enough layers to give
+ * about a third of the uncompressed size of a reduced page. The extra
+ * precision in later layers is invisible at that size, so thumbnails skip
+ * most entropy decoding. Page 0, and files without layer information,
+ * always decode every layer. The metadata item "kakadu-layers" is the
+ * number of layers decoded.
+ *
+ * The metadata item "kakadu-stats" is a #VipsArrayDouble of performance
+ * counters for this load: bytes read, reads, seeks, bytes written, writes,
+ * tiles decoded, microseconds spent decoding, kakadu threads, and peak
+ * kakadu codestream memory in bytes. Writes are always zero for load. The
+ * counters are updated as the image is computed.
+ *
  * Use @fail_on to set the type of error that will cause load to fail. By
  * default, loaders are permissive, that is, #VIPS_FAIL_ON_NONE.
  *
@@ -1230,6 +2537,20 @@ vips_kakaduload(const char *filename, VipsImage **out, ...)
  * Optional arguments:
  *
  * * @page: %gint, load this page
+ * * @numa: %gboolean, keep decode threads on one NUMA node
+ * * @block_size: %gint, read and cache the source in blocks of this size
+ * * @ranges: #VipsArrayDouble, prefetched byte ranges
+ * * @range_data: #VipsBlob, bytes of the prefetched ranges
+ * * @prefetch: %gint, decode up to this many neighbouring tiles
+ * * @cache_bytes: %guint64, keep up to this many bytes of decoded tiles
+ * * @shared_cache: %gboolean, share compressed data between loads
+ * * @cache_threshold: %gint, unload parsed codestream state past this size
+ * * @small_threshold: %gint, decode images up to this size in a single pass
+ * * @srgb: %gboolean, convert to sRGB during decode
+ * * @indexed: %gboolean, load palette images as indexes
+ * * @preset: #VipsKakaduPreset, trade decode speed against precision
+ * * @layers: %gint, number of quality layers to decode
+ * * @auto_layers: %gboolean, pick the number of layers from the page size
  * * @fail_on: #VipsFailOn, types of read error to fail on
  *
  * Exactly as vips_kakaduload(), but read from a buffer.
@@ -1268,6 +2589,20 @@ vips_kakaduload_buffer(void *buf, size_t len, VipsImage **out, ...)
  * Optional arguments:
  *
  * * @page: %gint, load this page
+ * * @numa: %gboolean, keep decode threads on one NUMA node
+ * * @block_size: %gint, read and cache the source in blocks of this size
+ * * @ranges: #VipsArrayDouble, prefetched byte ranges
+ * * @range_data: #VipsBlob, bytes of the prefetched ranges
+ * * @prefetch: %gint, decode up to this many neighbouring tiles
+ * * @cache_bytes: %guint64, keep up to this many bytes of decoded tiles
+ * * @shared_cache: %gboolean, share compressed data between loads
+ * * @cache_threshold: %gint, unload parsed codestream state past this size
+ * * @small_threshold: %gint, decode images up to this size in a single pass
+ * * @srgb: %gboolean, convert to sRGB during decode
+ * * @indexed: %gboolean, load palette images as indexes
+ * * @preset: #VipsKakaduPreset, trade decode speed against precision
+ * * @layers: %gint, number of quality layers to decode
+ * * @auto_layers: %gboolean, pick the number of layers from the page size
  * * @fail_on: #VipsFailOn, types of read error to fail on
  *
  * Exactly as vips_kakaduload(), but read from a source.
@@ -0,0 +1,388 @@
+/* find the byte ranges a jpeg2000 load will read
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+using namespace kdu_supp; // includes the core namespace
+
+typedef struct _VipsKakaduPlan {
+	VipsOperation parent_instance;
+
+	/* Plan reads from here.
+	 */
+	VipsSource *source;
+
+	/* The offset and length of each range.
+	 */
+	VipsArrayDouble *ranges;
+
+	/* As kakaduload page, and the number of quality layers, 0 for all.
+	 */
+	int page;
+	int layers;
+
+	/* The area to plan for, in page coordinates. Zero width for the whole
+	 * page.
+	 */
+	int left;
+	int top;
+	int width;
+	int height;
+
+	/* Input objects.
+	 */
+	VipsKakaduSource *kakadu_source;
+	jp2_family_src *input;
+	jpx_source *jpx;
+} VipsKakaduPlan;
+
+typedef VipsOperationClass VipsKakaduPlanClass;
+
+G_DEFINE_TYPE(VipsKakaduPlan, vips_kakaduplan, VIPS_TYPE_OPERATION);
+
+static void
+vips_kakaduplan_dispose(GObject *gobject)
+{
+	VipsKakaduPlan *plan = (VipsKakaduPlan *) gobject;
+
+#ifdef DEBUG
+	printf("vips_kakaduplan_dispose:\n");
+#endif /*DEBUG*/
+
+	DELETE(plan->input);
+	DELETE(plan->jpx);
+	DELETE(plan->kakadu_source);
+
+	G_OBJECT_CLASS(vips_kakaduplan_parent_class)->dispose(gobject);
+}
+
+/* Open every code-block in the valid tiles. This pulls in the packets for
+ * the precincts we need, up to the layer limit, without decoding them.
+ */
+static void
+vips_kakaduplan_blocks(kdu_codestream codestream)
+{
+	kdu_dims tiles;
+	codestream.get_valid_tiles(tiles);
+
+	kdu_coords t;
+	for (t.y = 0; t.y < tiles.size.y; t.y++)
+		for (t.x = 0; t.x < tiles.size.x; t.x++) {
+			kdu_tile tile = codestream.open_tile(t + tiles.pos);
+
+			int num_components = tile.get_num_components();
+			for (int c = 0; c < num_components; c++) {
+				kdu_tile_comp comp = tile.access_component(c);
+
+				int num_resolutions = comp.get_num_resolutions();
+				for (int r = 0; r < num_resolutions; r++) {
+					kdu_resolution res = comp.access_resolution(r);
+
+					int min_band;
+					int num_bands = res.get_valid_band_indices(min_band);
+					for (int b = min_band; b < min_band + num_bands; b++) {
+						kdu_subband band = res.access_subband(b);
+
+						kdu_dims blocks;
+						band.get_valid_blocks(blocks);
+
+						kdu_coords idx;
+						for (idx.y = 0; idx.y < blocks.size.y; idx.y++)
+							for (idx.x = 0; idx.x < blocks.size.x; idx.x++)
+								band.close_block(
+									band.open_block(idx + blocks.pos));
+					}
+				}
+			}
+
+			tile.close();
+		}
+}
+
+/* Any kakadu method can throw a kdu_exception, our caller must catch these.
+ */
+static int
+vips_kakaduplan_ranges(VipsKakaduPlan *plan, kdu_codestream &codestream,
+	std::vector<VipsKakaduRange> &ranges)
+{
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(plan);
+
+	plan->kakadu_source->set_ranges(&ranges);
+
+	plan->input->open(plan->kakadu_source);
+	if (plan->jpx->open(plan->input, true) <= 0) {
+		vips_error(klass->nickname,
+			"%s", _("raw codec plan not implemented"));
+		return -1;
+	}
+
+	jpx_codestream_source codestream_source = plan->jpx->access_codestream(0);
+	codestream.create(codestream_source.open_stream());
+
+	int levels = 0;
+	codestream.access_siz()->access_cluster(COD_params)->
+		get(Clevels, 0, 0, levels);
+	if (plan->page > levels) {
+		vips_error(klass->nickname,
+			_("page should be no more than %d"), levels);
+		return -1;
+	}
+
+	codestream.apply_input_restrictions(0, 0, plan->page, plan->layers,
+		NULL, KDU_WANT_CODESTREAM_COMPONENTS);
+
+	kdu_dims dims;
+	codestream.get_dims(0, dims);
+	VipsRect image = { 0, 0, dims.size.x, dims.size.y };
+
+	// kakaduload decodes whole cache tiles, so expand the area to match
+	VipsRect area = image;
+	if (plan->width > 0) {
+		VipsRect request = { plan->left, plan->top,
+			plan->width, plan->height };
+		if (vips_rect_isempty(&request) ||
+			!vips_rect_includesrect(&image, &request)) {
+			vips_error(klass->nickname, "%s", _("bad area"));
+			return -1;
+		}
+
+		kdu_dims partition;
+		codestream.get_tile_partition(partition);
+		int tile_width = VIPS_MIN(partition.size.x,
+			VIPS_MIN(image.width, VIPS_KAKADU_MAX_CACHE_TILE_SIZE));
+		int tile_height = VIPS_MIN(partition.size.y,
+			VIPS_MIN(image.height, VIPS_KAKADU_MAX_CACHE_TILE_SIZE));
+
+		area.left = VIPS_ROUND_DOWN(request.left, tile_width);
+		area.top = VIPS_ROUND_DOWN(request.top, tile_height);
+		area.width = VIPS_ROUND_UP(VIPS_RECT_RIGHT(&request), tile_width) -
+			area.left;
+		area.height = VIPS_ROUND_UP(VIPS_RECT_BOTTOM(&request),
+			tile_height) - area.top;
+		vips_rect_intersectrect(&area, &image, &area);
+	}
+
+#ifdef DEBUG
+	printf("vips_kakaduplan_ranges: area %d x %d at %d, %d\n",
+		area.width, area.height, area.left, area.top);
+#endif /*DEBUG*/
+
+	// restrict the codestream to the area, on the full resolution canvas
+	kdu_dims region;
+	region.pos = dims.pos + kdu_coords(area.left, area.top);
+	region.size = kdu_coords(area.width, area.height);
+	region = codestream.map_region(0, region);
+	codestream.apply_input_restrictions(0, 0, plan->page, plan->layers,
+		&region, KDU_WANT_CODESTREAM_COMPONENTS);
+
+	vips_kakaduplan_blocks(codestream);
+
+	codestream.destroy();
+
+	return 0;
+}
+
+static int
+vips_kakaduplan_build(VipsObject *object)
+{
+	VipsKakaduPlan *plan = (VipsKakaduPlan *) object;
+
+#ifdef DEBUG
+	printf("vips_kakaduplan_build:\n");
+#endif /*DEBUG*/
+
+	if (VIPS_OBJECT_CLASS(vips_kakaduplan_parent_class)->build(object))
+		return -1;
+
+	plan->kakadu_source = new VipsKakaduSource(plan->source);
+	plan->input = new jp2_family_src();
+	plan->jpx = new jpx_source();
+
+	kdu_codestream codestream;
+	std::vector<VipsKakaduRange> ranges;
+
+	int result;
+
+	try {
+		result = vips_kakaduplan_ranges(plan, codestream, ranges);
+	}
+	catch (kdu_exception e) {
+		// the message has been handled already
+		result = -1;
+	}
+
+	if (codestream.exists())
+		codestream.destroy();
+
+	if (result)
+		return -1;
+
+	// kakadu reads headers and packets in any order, and can read parts
+	// more than once, so sort and merge
+	std::sort(ranges.begin(), ranges.end());
+	std::vector<double> merged;
+	for (auto &range : ranges) {
+		int n = merged.size();
+
+		if (n > 0 &&
+			range.first <= merged[n - 2] + merged[n - 1])
+			merged[n - 1] = VIPS_MAX(merged[n - 1],
+				range.first + range.second - merged[n - 2]);
+		else {
+			merged.push_back(range.first);
+			merged.push_back(range.second);
+		}
+	}
+
+#ifdef DEBUG
+	printf("vips_kakaduplan_build: %zd reads in %zd ranges\n",
+		ranges.size(), merged.size() / 2);
+#endif /*DEBUG*/
+
+	VipsArrayDouble *array =
+		vips_array_double_new(merged.data(), merged.size());
+	g_object_set(object, "ranges", array, NULL);
+	vips_area_unref(VIPS_AREA(array));
+
+	return 0;
+}
+
+static void
+vips_kakaduplan_class_init(VipsKakaduPlanClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	VipsObjectClass *object_class = (VipsObjectClass *) klass;
+	VipsOperationClass *operation_class = VIPS_OPERATION_CLASS(klass);
+
+	gobject_class->dispose = vips_kakaduplan_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "kakaduplan";
+	object_class->description =
+		_("find the byte ranges a JPEG2000 load will read");
+	object_class->build = vips_kakaduplan_build;
+
+	// sources can't be reused
+	operation_class->flags = VIPS_OPERATION_NOCACHE;
+
+	VIPS_ARG_OBJECT(klass, "source", 1,
+		_("Source"),
+		_("Source to plan reads from"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, source),
+		VIPS_TYPE_SOURCE);
+
+	VIPS_ARG_BOXED(klass, "ranges", 2,
+		_("Ranges"),
+		_("Offset and length of each byte range"),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, ranges),
+		VIPS_TYPE_ARRAY_DOUBLE);
+
+	VIPS_ARG_INT(klass, "page", 10,
+		_("Page"),
+		_("Plan for this page, as kakaduload page"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, page),
+		0, 32, 0);
+
+	VIPS_ARG_INT(klass, "layers", 11,
+		_("Layers"),
+		_("Number of quality layers to read, 0 for all"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, layers),
+		0, 16384, 0);
+
+	VIPS_ARG_INT(klass, "left", 12,
+		_("Left"),
+		_("Left edge of area"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, left),
+		0, VIPS_MAX_COORD, 0);
+
+	VIPS_ARG_INT(klass, "top", 13,
+		_("Top"),
+		_("Top edge of area"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, top),
+		0, VIPS_MAX_COORD, 0);
+
+	VIPS_ARG_INT(klass, "width", 14,
+		_("Width"),
+		_("Width of area, 0 for the whole page"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, width),
+		0, VIPS_MAX_COORD, 0);
+
+	VIPS_ARG_INT(klass, "height", 15,
+		_("Height"),
+		_("Height of area"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduPlan, height),
+		0, VIPS_MAX_COORD, 0);
+}
+
+static void
+vips_kakaduplan_init(VipsKakaduPlan *plan)
+{
+}
+
+/**
+ * vips_kakaduplan:
+ * @source: source to plan reads from
+ * @ranges: (out): offset and length of each byte range
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @page: %gint, plan for this page
+ * * @layers: %gint, number of quality layers to read
+ * * @left: %gint, left edge of area
+ * * @top: %gint, top edge of area
+ * * @width: %gint, width of area
+ * * @height: %gint, height of area
+ *
+ * Find the byte ranges vips_kakaduload() will read to decode an area of a
+ * JPEG2000 image. @ranges is the offset and length of each range, sorted
+ * and merged, so a remote source can fetch exactly those bytes, perhaps
+ * with a single multi-range request, and pass them to the loader with
+ * the @ranges and @range_data options.
+ *
+ * The area is given in the coordinates of @page, and is expanded to the
+ * tiles kakaduload decodes. The default is the whole page. Use @layers to
+ * plan for a lower quality decode.
+ *
+ * The plan opens every code-block in the area, which reads the headers and
+ * all the packets we need, but nothing is decoded. Images with PLT markers
+ * (see the ORGgen_plt option to vips_kakadusave()) let kakadu seek straight
+ * to the packets for the area, so they give much smaller plans.
+ *
+ * See also: vips_kakaduload().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_kakaduplan(VipsSource *source, VipsArrayDouble **ranges, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, ranges);
+	result = vips_call_split("kakaduplan", ap, source, ranges);
+	va_end(ap);
+
+	return result;
+}
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include <vips/vips.h>
 
@@ -21,117 +22,295 @@ using namespace kdu_supp; // includes the core namespace
 // ie. 2^32 on a log2 scale
 #define MAX_LAYER_COUNT (32)
 
-/* A VipsTarget as a Kakadu output object. This keeps the reference
- * alive while it's alive.
+/* Kakadu emits compressed data in small chunks. We gather these into a large
+ * buffer and write in big, aligned blocks, which is much kinder to network
+ * filesystems.
  */
-class VipsKakaduTarget : public kdu_compressed_target {
-public:
-	VipsKakaduTarget()
-	{
+#define WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* When writing to memory, grow the buffer by at least this much each time.
+ */
+#define MEMORY_GROW_MIN (1024 * 1024)
+
+/* Images with more than this many pixels are written incrementally, with a
+ * flush every time about FLUSH_PIXELS have been pushed.
+ */
+#define INCREMENTAL_THRESHOLD (256 * 1024 * 1024)
+#define FLUSH_PIXELS (32 * 1024 * 1024)
+
+/* Precinct size at full resolution, in pixels, when writing incrementally.
+ */
+#define INCREMENTAL_PRECINCT_SIZE (256)
+
+VipsKakaduTarget::VipsKakaduTarget()
+{
 #ifdef DEBUG_VERBOSE
-		printf("new VipsKakaduTarget:\n");
+	printf("new VipsKakaduTarget:\n");
 #endif /*DEBUG_VERBOSE*/
 
-		target = NULL;
-	}
+	target = NULL;
+	buffer = NULL;
+}
 
-	~VipsKakaduTarget()
-	{
+VipsKakaduTarget::~VipsKakaduTarget()
+{
 #ifdef DEBUG_VERBOSE
-		printf("~VipsKakaduTarget:\n");
+	printf("~VipsKakaduTarget:\n");
 #endif /*DEBUG_VERBOSE*/
 
-		close();
-	}
+	close();
+}
 
-	bool exists() 
-	{ 
-		return target != NULL; 
-	}
+bool
+VipsKakaduTarget::open(VipsTarget *_target)
+{
+#ifdef DEBUG_VERBOSE
+	printf("VipsKakaduTarget::open()\n");
+#endif /*DEBUG_VERBOSE*/
+
+	close();
+
+	target = _target;
+	g_object_ref(target);
+
+	buffer_size = WRITE_BUFFER_SIZE;
+	buffer = (kdu_byte *) g_malloc(buffer_size);
+	buffer_start = 0;
+	buffer_length = 0;
+	position = 0;
+	in_rewrite = false;
+
+	return true;
+}
 
-	bool operator!() 
-	{ 
-		return target == NULL; 
+bool
+VipsKakaduTarget::open_memory(kdu_long initial_size)
+{
+#ifdef DEBUG_VERBOSE
+	printf("VipsKakaduTarget::open_memory(%lld)\n", initial_size);
+#endif /*DEBUG_VERBOSE*/
+
+	close();
+
+	to_memory = true;
+	buffer_size = VIPS_MAX(initial_size, 4096);
+	if (!(buffer = (kdu_byte *) g_try_malloc(buffer_size))) {
+		vips_error("VipsKakaduTarget", "%s", _("out of memory"));
+		return false;
 	}
+	buffer_start = 0;
+	buffer_length = 0;
+	position = 0;
+	in_rewrite = false;
 
-	bool open(VipsTarget *_target)
-	{
+	return true;
+}
+
+void *
+VipsKakaduTarget::steal(size_t *length)
+{
+	void *data;
+
+	// trim any unused space ... this is a shrink, so the allocator
+	// can usually do it in place
+	if (buffer_length < buffer_size &&
+		buffer_length > 0)
+		buffer = (kdu_byte *) g_realloc(buffer, buffer_length);
+
+	data = buffer;
+	*length = buffer_length;
+
+	vips_kakadu_stats_add(stats, 
+		VIPS_KAKADU_STATS_BYTES_WRITTEN, buffer_length);
+
+	buffer = NULL;
+	buffer_size = 0;
+	buffer_length = 0;
+	position = 0;
+
+	return data;
+}
+
+void
+VipsKakaduTarget::preallocate(kdu_long length)
+{
 #ifdef DEBUG_VERBOSE
-		printf("VipsKakaduTarget::open()\n");
+	printf("VipsKakaduTarget: preallocate(%lld)\n", length);
 #endif /*DEBUG_VERBOSE*/
 
-		close();
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (!target)
+		return;
 
-		target = _target;
-		g_object_ref(target);
+	int descriptor = VIPS_CONNECTION(target)->descriptor;
 
-		return true;
-	}
+	// only a hint, so ignore errors, eg. from filesystems which don't 
+	// support fallocate()
+	if (descriptor >= 0 && 
+		length > 0)
+		(void) fallocate(descriptor, FALLOC_FL_KEEP_SIZE, 0, length);
+#endif /*FALLOC_FL_KEEP_SIZE*/
+}
 
-	int get_capabilities() 
-	{
-		// a simple byte target
-		return KDU_TARGET_CAP_SEQUENTIAL;
+int
+VipsKakaduTarget::get_capabilities() 
+{
+	// a simple byte target ... kakadu discovers rewrite support by
+	// calling start_rewrite()
+	return KDU_TARGET_CAP_SEQUENTIAL;
+}
+
+bool
+VipsKakaduTarget::start_rewrite(kdu_long backtrack)
+{
+#ifdef DEBUG_VERBOSE
+	printf("VipsKakaduTarget: start_rewrite(%lld)\n", backtrack);
+#endif /*DEBUG_VERBOSE*/
+
+	if (in_rewrite ||
+		backtrack < 0 || 
+		backtrack > position)
+		return false;
+
+	// rewrites before the buffer need a seekable target ... rewrites 
+	// inside the buffer work even for pipes
+	if (position - backtrack < buffer_start &&
+		vips_target_seek(target, 0, SEEK_CUR) < 0) {
+		// kakadu will fall back to not rewriting, so this isn't an error
+		vips_error_clear();
+		return false;
 	}
 
-	virtual bool start_rewrite(kdu_long backtrack)
-	{
+	saved_position = position;
+	position -= backtrack;
+	in_rewrite = true;
+
+	return true;
+}
+
+bool
+VipsKakaduTarget::end_rewrite()
+{
 #ifdef DEBUG_VERBOSE
-		printf("VipsKakaduTarget: start_rewrite(%lld)\n", backtrack);
+	printf("VipsKakaduTarget: end_rewrite\n");
 #endif /*DEBUG_VERBOSE*/
 
-		if (in_rewrite)
-			return false;
+	if (!in_rewrite)
+		return false;
 
-		saved_position = vips_target_seek(target, 0, SEEK_CUR);
-		if (backtrack < 0 || saved_position - backtrack < 0)
-			return false;
+	position = saved_position;
+	in_rewrite = false;
 
-		vips_target_seek(target, -backtrack, SEEK_CUR);
-		in_rewrite = true;
+	return true;
+}
 
-		return true;
+bool
+VipsKakaduTarget::write(const kdu_byte *buf, int num_bytes)
+{
+#ifdef DEBUG_VERBOSE
+	printf("VipsKakaduTarget: write %d bytes ...\n", num_bytes);
+#endif /*DEBUG_VERBOSE*/
+
+	while (num_bytes > 0) {
+		int n;
+
+		if (position < buffer_start) {
+			// a rewrite into data we've already flushed ... these are
+			// small, so patch the target directly, then return to the 
+			// end of the flushed area
+			n = VIPS_MIN(num_bytes, buffer_start - position);
+
+			if (vips_target_seek(target, 
+					position - buffer_start, SEEK_CUR) < 0 ||
+				vips_target_write(target, buf, n) ||
+				vips_target_seek(target, 
+					buffer_start - (position + n), SEEK_CUR) < 0)
+				return false;
+
+			vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_SEEKS, 2);
+			vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_WRITES, 1);
+		}
+		else {
+			kdu_long offset = position - buffer_start;
+
+			if (offset >= buffer_size) {
+				if (!(to_memory ? grow() : flush()))
+					return false;
+				continue;
+			}
+
+			n = VIPS_MIN(num_bytes, buffer_size - offset);
+			memcpy(buffer + offset, buf, n);
+			buffer_length = VIPS_MAX(buffer_length, offset + n);
+		}
+
+		position += n;
+		buf += n;
+		num_bytes -= n;
 	}
 
-	virtual bool end_rewrite()
-	{
+	return true;
+}
+
+bool
+VipsKakaduTarget::flush()
+{
 #ifdef DEBUG_VERBOSE
-		printf("VipsKakaduTarget: end_rewrite\n");
+	printf("VipsKakaduTarget: flush() %lld bytes\n", buffer_length);
 #endif /*DEBUG_VERBOSE*/
 
-		if (!in_rewrite)
+	if (target &&
+		buffer_length > 0) {
+		if (vips_target_write(target, buffer, buffer_length))
 			return false;
 
-		vips_target_seek(target, saved_position, SEEK_SET);
-		in_rewrite = false;
+		vips_kakadu_stats_add(stats, VIPS_KAKADU_STATS_WRITES, 1);
+		vips_kakadu_stats_add(stats, 
+			VIPS_KAKADU_STATS_BYTES_WRITTEN, buffer_length);
 
-		return true;
+		buffer_start += buffer_length;
+		buffer_length = 0;
 	}
 
-	virtual bool write(const kdu_byte *buf, int num_bytes)
-	{
+	return true;
+}
+
+bool
+VipsKakaduTarget::close()
+{
 #ifdef DEBUG_VERBOSE
-		printf("VipsKakaduTarget: write %d bytes ...\n", num_bytes);
+	printf("VipsKakaduTarget: close()\n");
 #endif /*DEBUG_VERBOSE*/
 
-		return !vips_target_write(target, buf, num_bytes);
-	}
+	bool result = flush();
+
+	VIPS_UNREF(target);
+	VIPS_FREE(buffer);
+	to_memory = false;
+
+	return result;
+}
+
+bool
+VipsKakaduTarget::grow()
+{
+	kdu_long new_size = buffer_size + 
+		VIPS_MAX(buffer_size, MEMORY_GROW_MIN);
+	kdu_byte *new_buffer;
 
-	virtual bool close()
-	{
 #ifdef DEBUG_VERBOSE
-		printf("VipsKakaduTarget: close()\n");
+	printf("VipsKakaduTarget: grow() to %lld bytes\n", new_size);
 #endif /*DEBUG_VERBOSE*/
 
-		VIPS_UNREF(target);
-		return true;
+	if (!(new_buffer = (kdu_byte *) g_try_realloc(buffer, new_size))) {
+		vips_error("VipsKakaduTarget", "%s", _("out of memory"));
+		return false;
 	}
+	buffer = new_buffer;
+	buffer_size = new_size;
 
-private:
-	VipsTarget *target;
-	gint64 saved_position = 0;
-	bool in_rewrite = false;
-};
+	return true;
+}
 
 typedef struct _VipsForeignSaveKakadu {
 	VipsForeignSave parent_object;
@@ -140,10 +319,15 @@ typedef struct _VipsForeignSaveKakadu {
 	 */
 	VipsTarget *target;
 
-	/* "target" wrapped up as a kakadu byte data target.
+	/* "target" wrapped up as a kakadu byte data target. If target is NULL,
+	 * we write to memory instead.
 	 */
 	VipsKakaduTarget *kakadu_target;
 
+	/* The output, for memory saves.
+	 */
+	VipsBlob *blob;
+
 	int tile_width;
 	int tile_height;
 
@@ -161,17 +345,41 @@ typedef struct _VipsForeignSaveKakadu {
 	 */
 	int Q;
 
-	/* Rate.
+	/* Rate, in bits per pixel, per layer.
 	 */
 	VipsArea *rate;
 
+	/* Cap the total file size at this many bytes.
+	 */
+	guint64 target_size;
+
+	/* Rate control can stop when within this fraction of the target size.
+	 */
+	double size_tolerance;
+
+	/* Fixed distortion-length slope per layer.
+	 */
+	VipsArea *slopes;
+
 	/* Chroma subsample mode.
 	 */
 	VipsForeignSubsample subsample_mode;
 
+	/* Keep encode threads on one NUMA node.
+	 */
+	gboolean numa;
+
+	/* Trade encode speed against precision.
+	 */
+	VipsKakaduPreset preset;
+
+	/* Performance counters, the "stats" output.
+	 */
+	VipsArea *stats;
+
 	/* Encoder state.
 	 */
-	kdu_thread_env *env;
+	VipsKakaduThreads *threads;
 	kdu_stripe_compressor *compressor;
 
 	/* The line of tiles we are building, and the buffer we
@@ -183,6 +391,11 @@ typedef struct _VipsForeignSaveKakadu {
 	int *precisions;
 	bool *is_signed;
 
+	/* Flush the codestream after this many lines, or 0 to write it all at
+	 * the end.
+	 */
+	int flush_period;
+
 	/* If we need to subsample during unpacking.
 	 */
 	gboolean subsample;
@@ -206,13 +419,18 @@ vips_foreign_save_kakadu_dispose(GObject *gobject)
 {
 	VipsForeignSaveKakadu *kakadu = (VipsForeignSaveKakadu *) gobject;
 
-	DELETE(kakadu->env);
 	DELETE(kakadu->compressor);
+	DELETE(kakadu->threads);
 	DELETE(kakadu->kakadu_target);
 
 	VIPS_UNREF(kakadu->target);
 	VIPS_UNREF(kakadu->strip);
 
+	if (kakadu->blob) {
+		vips_area_unref(VIPS_AREA(kakadu->blob));
+		kakadu->blob = NULL;
+	}
+
 	VIPS_FREE(kakadu->tile_buffer);
 	VIPS_FREE(kakadu->accumulate);
 	VIPS_FREE(kakadu->stripe_heights);
@@ -244,6 +462,9 @@ vips_foreign_save_kakadu_write_block(VipsRegion *region, VipsRect *area,
 	const int *sample_gaps = NULL;
 	const int *row_gaps = NULL;
 
+	VipsKakaduSpan span("push stripe", r);
+	gint64 start = g_get_monotonic_time();
+
 	try {
 		switch (image->BandFmt) {
 		case VIPS_FORMAT_UCHAR:
@@ -253,7 +474,8 @@ vips_foreign_save_kakadu_write_block(VipsRegion *region, VipsRect *area,
 				sample_offsets,
 				sample_gaps,
 				row_gaps,
-				kakadu->precisions);
+				kakadu->precisions,
+				kakadu->flush_period);
 			break;
 
 		case VIPS_FORMAT_USHORT:
@@ -264,7 +486,8 @@ vips_foreign_save_kakadu_write_block(VipsRegion *region, VipsRect *area,
 				sample_gaps,
 				row_gaps,
 				kakadu->precisions,
-				kakadu->is_signed);
+				kakadu->is_signed,
+				kakadu->flush_period);
 			break;
 
 		case VIPS_FORMAT_FLOAT:
@@ -275,7 +498,8 @@ vips_foreign_save_kakadu_write_block(VipsRegion *region, VipsRect *area,
 				sample_gaps,
 				row_gaps,
 				kakadu->precisions,
-				kakadu->is_signed);
+				kakadu->is_signed,
+				kakadu->flush_period);
 			break;
 
 		default:
@@ -287,6 +511,196 @@ vips_foreign_save_kakadu_write_block(VipsRegion *region, VipsRect *area,
 		return -1;
 	}
 
+	vips_kakadu_stats_add(kakadu->stats, VIPS_KAKADU_STATS_TILES, 1);
+	vips_kakadu_stats_add(kakadu->stats, VIPS_KAKADU_STATS_PROCESS_USEC,
+		g_get_monotonic_time() - start);
+
+	return 0;
+}
+
+/* Estimate the size of the compressed output. If there's no rate to go on,
+ * return 0, or with @guess, make a rough guess from Q and the image size.
+ */
+static kdu_long
+vips_foreign_save_kakadu_estimate_size(VipsForeignSaveKakadu *kakadu, 
+	VipsImage *image, gboolean guess)
+{
+	kdu_long size = 0;
+
+	// the final layer is the largest
+	if (kakadu->rate)
+		for (int i = 0; i < kakadu->rate->n; i++) 
+			size = VIPS_MAX(size, VIPS_IMAGE_N_PELS(image) * 
+				0.125 * ((double *) kakadu->rate->data)[i]);
+	if (kakadu->target_size > 0)
+		size = size > 0 ? 
+			VIPS_MIN(size, kakadu->target_size) : kakadu->target_size;
+
+	if (size == 0 &&
+		guess) {
+		kdu_long uncompressed = VIPS_IMAGE_SIZEOF_IMAGE(image);
+
+		// lossless is typically about 2:1, and the default Q of 48 is
+		// about 8:1
+		if (kakadu->lossless)
+			size = uncompressed / 2;
+		else
+			size = uncompressed * kakadu->Q / 400;
+
+		// the buffer will grow if we're wrong, so don't go crazy
+		size = VIPS_MIN(size, 256 * 1024 * 1024);
+	}
+
+	// plus some space for headers and metadata
+	if (size > 0)
+		size += 64 * 1024;
+
+	return size;
+}
+
+/* Map Q to a kakadu distortion-length slope threshold. These are on a log
+ * scale: each step of 256 doubles the slope, which is roughly 3dB of PSNR.
+ * 
+ * This is a rough calibration against natural images, with the default Q of
+ * 48 giving a file of about the same size as a regular jpg at Q 75.
+ */
+static kdu_uint16
+vips_foreign_save_kakadu_Q_to_slope(int Q)
+{
+	return 48000 - (Q - 1) * 8000 / 99;
+}
+
+/* Turn the rate, size and slope arguments into layer specs for the 
+ * compressor. num_layer_specs is zero if we should use kakadu's defaults.
+ *
+ * header_bytes is the number of bytes we've already written (the jp2 
+ * header), and must come out of any target_size.
+ */
+/* Set the codestream up so kakadu can write it as we go. Packets are only
+ * complete once every resolution has seen the same area, so we need a
+ * position-first order, and precincts which cover the same 256 pixels at
+ * every resolution. PLT markers let loads find the precincts again. We
+ * leave anything the user set in @options alone.
+ */
+static void
+vips_foreign_save_kakadu_incremental(kdu_codestream codestream)
+{
+	kdu_params *cod = codestream.access_siz()->access_cluster(COD_params);
+	kdu_params *org = codestream.access_siz()->access_cluster(ORG_params);
+	int order;
+	int precinct;
+	bool plt;
+
+	if (!cod->get(Corder, 0, 0, order))
+		cod->set(Corder, 0, 0, Corder_PCRL);
+
+	if (!cod->get(Cprecincts, 0, 0, precinct)) {
+		cod->set(Cuse_precincts, 0, 0, true);
+
+		// halve at each level, kakadu repeats the last one
+		for (int i = 0; i < 6; i++) {
+			int size = VIPS_MAX(8, INCREMENTAL_PRECINCT_SIZE >> i);
+
+			cod->set(Cprecincts, i, 0, size);
+			cod->set(Cprecincts, i, 1, size);
+		}
+	}
+
+	if (!org->get(ORGgen_plt, 0, 0, plt))
+		org->set(ORGgen_plt, 0, 0, true);
+}
+
+static int
+vips_foreign_save_kakadu_layer_specs(VipsForeignSaveKakadu *kakadu,
+	VipsImage *image,
+	kdu_long header_bytes,
+	int *num_layer_specs, 
+	kdu_long layer_sizes[MAX_LAYER_COUNT],
+	kdu_uint16 layer_slopes[MAX_LAYER_COUNT])
+{
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(kakadu);
+
+	*num_layer_specs = 0;
+
+	if (kakadu->slopes && 
+		(kakadu->rate || kakadu->target_size > 0)) {
+		vips_error(klass->nickname, 
+			"%s", _("slopes can't be used with rate or target_size"));
+		return -1;
+	}
+
+	if (kakadu->rate) {
+		double *rate = (double *) kakadu->rate->data;
+
+		if (kakadu->rate->n > MAX_LAYER_COUNT) {
+			vips_error(klass->nickname, 
+				_("at most %d rates"), MAX_LAYER_COUNT);
+			return -1;
+		}
+
+		for (int i = 0; i < kakadu->rate->n; i++) {
+			if (rate[i] <= 0.0 ||
+				(i > 0 && 
+				 rate[i] < rate[i - 1])) {
+				vips_error(klass->nickname, "%s", 
+					_("rates must be positive and increasing"));
+				return -1;
+			}
+
+			layer_sizes[i] = VIPS_IMAGE_N_PELS(image) * 0.125 * rate[i];
+		}
+		*num_layer_specs = kakadu->rate->n;
+	}
+
+	if (kakadu->target_size > 0) {
+		kdu_long size = (kdu_long) kakadu->target_size - header_bytes;
+
+		if (size <= 0) {
+			vips_error(klass->nickname, "%s", 
+				_("target_size is smaller than the file header"));
+			return -1;
+		}
+
+		// target_size sets the size of the final layer, and caps any
+		// earlier ones
+		if (*num_layer_specs == 0)
+			*num_layer_specs = 1;
+		for (int i = 0; i < *num_layer_specs; i++)
+			layer_sizes[i] = VIPS_MIN(layer_sizes[i], size);
+		layer_sizes[*num_layer_specs - 1] = size;
+	}
+	else if (kakadu->slopes) {
+		int *slopes = (int *) kakadu->slopes->data;
+
+		if (kakadu->slopes->n > MAX_LAYER_COUNT) {
+			vips_error(klass->nickname, 
+				_("at most %d slopes"), MAX_LAYER_COUNT);
+			return -1;
+		}
+
+		// slopes must be decreasing, since later layers add more detail
+		for (int i = 0; i < kakadu->slopes->n; i++) {
+			if (slopes[i] < 1 || 
+				slopes[i] > 65535 ||
+				(i > 0 && 
+				 slopes[i] >= slopes[i - 1])) {
+				vips_error(klass->nickname, "%s", 
+					_("slopes must be decreasing and in the range 1 - 65535"));
+				return -1;
+			}
+
+			layer_slopes[i] = slopes[i];
+		}
+		*num_layer_specs = kakadu->slopes->n;
+	}
+	else if (!kakadu->rate &&
+		!kakadu->lossless &&
+		vips_object_argument_isset(VIPS_OBJECT(kakadu), "Q")) {
+		// Q is the fallback, so it must not replace the rate layers
+		layer_slopes[0] = vips_foreign_save_kakadu_Q_to_slope(kakadu->Q);
+		*num_layer_specs = 1;
+	}
+
 	return 0;
 }
 
@@ -302,6 +716,14 @@ vips_foreign_save_kakadu_build(VipsObject *object)
 	VipsForeignSave *save = (VipsForeignSave *) object;
 	VipsForeignSaveKakadu *kakadu = (VipsForeignSaveKakadu *) object;
 
+	VipsKakaduSpan span("kakadusave");
+
+	// we update the counters in place, so anyone holding the output sees
+	// them change
+	VipsArea *stats = vips_kakadu_stats_new();
+	g_object_set(object, "stats", stats, NULL);
+	vips_area_unref(stats);
+
 	// any kakadu method can throw a kdu_exception ... we must catch these 
 	// and return an error instead
 	//
@@ -315,8 +737,9 @@ vips_foreign_save_kakadu_build(VipsObject *object)
 
 		// see if we have something like a jph filename and enable 
 		// high-throughput compression
-		const char *filename = 
-			vips_connection_filename(VIPS_CONNECTION(kakadu->target));
+		const char *filename = kakadu->target ?
+			vips_connection_filename(VIPS_CONNECTION(kakadu->target)) : 
+			NULL;
 		if (filename && 
 			vips_filename_suffix_match(filename, vips__jph_suffix))
 			kakadu->htj2k = true;
@@ -356,7 +779,17 @@ vips_foreign_save_kakadu_build(VipsObject *object)
 
 		// a kdu_compressed_target
 		kakadu->kakadu_target = new VipsKakaduTarget();
-		kakadu->kakadu_target->open(kakadu->target);
+		kakadu->kakadu_target->set_stats(kakadu->stats);
+		if (kakadu->target) {
+			kakadu->kakadu_target->open(kakadu->target);
+			kakadu->kakadu_target->preallocate(
+				vips_foreign_save_kakadu_estimate_size(kakadu, 
+					image, FALSE));
+		}
+		else if (!kakadu->kakadu_target->open_memory(
+				vips_foreign_save_kakadu_estimate_size(kakadu, 
+					image, TRUE)))
+			return -1;
 
 		jp2_family_tgt target;
 		target.open(kakadu->kakadu_target);
@@ -421,44 +854,77 @@ vips_foreign_save_kakadu_build(VipsObject *object)
 				}
 		}
 
-		output.write_header();
-		output.open_codestream(true);
+		// the fast preset lets the classic block coder skip arithmetic
+		// coding for the lower bit-planes, unless the user set the modes
+		if (kakadu->preset == VIPS_KAKADU_PRESET_FAST &&
+			!kakadu->htj2k) {
+			kdu_params *cod = 
+				codestream.access_siz()->access_cluster(COD_params);
+			int modes;
 
-		kakadu->compressor = new kdu_stripe_compressor();
+			if (!cod->get(Cmodes, 0, 0, modes))
+				cod->set(Cmodes, 0, 0, Cmodes_BYPASS);
+		}
 
-		// 16 seems like a sensible limit ... we want to avoid overcommitting
-		// thread resources if we can
-		int n_threads = VIPS_MIN(16, vips_concurrency_get());
+		// huge images would otherwise keep every compressed code-block
+		// in memory until finish()
+		if ((guint64) image->Xsize * image->Ysize > INCREMENTAL_THRESHOLD) {
+			vips_foreign_save_kakadu_incremental(codestream);
+			kakadu->flush_period = VIPS_MAX(INCREMENTAL_PRECINCT_SIZE,
+				FLUSH_PIXELS / image->Xsize);
+		}
 
-		kdu_thread_env env;
-		env.create();
-		for (int i = 0; i < n_threads; i++)
-			if (!env.add_thread()) {
-				vips_error(klass->nickname, "%s", "thread create failed");
-				return -1;
-			}
+		output.write_header();
+		output.open_codestream(true);
 
-		// FIXME ... need to check vector lengths when we add more array args
-		int num_layer_specs = kakadu->rate ? kakadu->rate->n : 0;
+		// the jp2 header is written first, so we know how much of 
+		// target_size is left for the codestream
+		int num_layer_specs;
 		kdu_long layer_sizes[MAX_LAYER_COUNT] = { 0 };
-		for (int i = 0; i < num_layer_specs; i++) 
-			layer_sizes[i] = VIPS_IMAGE_N_PELS(image) * 
-				0.125 * ((int *) kakadu->rate->data)[i];
+		kdu_uint16 layer_slopes[MAX_LAYER_COUNT] = { 0 };
+		if (vips_foreign_save_kakadu_layer_specs(kakadu, image,
+			kakadu->kakadu_target->get_position(),
+			&num_layer_specs, layer_sizes, layer_slopes))
+			return -1;
 
-		const kdu_uint16 *layer_slopes = NULL;
+		// one quality layer per layer spec, unless the user has set the
+		// number of layers explicitly
+		if (num_layer_specs > 0) {
+			kdu_params *cod = 
+				codestream.access_siz()->access_cluster(COD_params);
+			int layers;
 
-		kdu_uint16 min_slope_threshold = 0;
-		bool no_auto_complexity_control = false;
-		bool force_precise = false;
+			if (!cod->get(Clayers, 0, 0, layers))
+				cod->set(Clayers, 0, 0, num_layer_specs);
+		}
+
+		kakadu->compressor = new kdu_stripe_compressor();
+
+		// borrow worker threads from the plugin-wide pool
+		kakadu->threads = new VipsKakaduThreads(kakadu->numa);
+		vips_kakadu_stats_max(kakadu->stats, VIPS_KAKADU_STATS_THREADS,
+			kakadu->threads->get_num_threads());
+
+		// with fixed slopes, kakadu can skip coding passes which will be
+		// discarded, and there's no rate control search
+		gboolean fixed_slope = num_layer_specs > 0 && layer_slopes[0];
+		kdu_uint16 min_slope_threshold = fixed_slope ? 
+			layer_slopes[num_layer_specs - 1] : 0;
+
+		// precise always works in 32-bit and codes every pass, fast lets
+		// kakadu use its quickest transforms
+		bool no_auto_complexity_control = 
+			kakadu->preset == VIPS_KAKADU_PRESET_PRECISE;
+		bool force_precise = kakadu->preset == VIPS_KAKADU_PRESET_PRECISE;
 		bool record_layer_info_in_comment = true;
-		double size_tolerance = 0.0;
+		double size_tolerance = kakadu->size_tolerance;
 		int num_components = 0;
-		bool want_fastest = false;
+		bool want_fastest = kakadu->preset == VIPS_KAKADU_PRESET_FAST;
 
 		kakadu->compressor->start(codestream, 
 			num_layer_specs,
-			layer_sizes,
-			layer_slopes,
+			fixed_slope ? NULL : layer_sizes,
+			fixed_slope ? layer_slopes : NULL,
 			min_slope_threshold,
 			no_auto_complexity_control,
 			force_precise,
@@ -466,18 +932,37 @@ vips_foreign_save_kakadu_build(VipsObject *object)
 			size_tolerance,
 			num_components,
 			want_fastest,
-			&env);
+			kakadu->threads->get());
 
 		if (vips_sink_disc(image, vips_foreign_save_kakadu_write_block, kakadu))
 			return -1;
 
+		VipsKakaduSpan finish_span("compressor finish");
 		kakadu->compressor->finish();
+		finish_span.end();
+
+		// return the threads to the pool as soon as we can
+		kakadu->threads->finished(codestream);
+		DELETE(kakadu->threads);
 
+		vips_kakadu_stats_memory(kakadu->stats, codestream);
 		codestream.destroy();
 		output.close();
 
-		if (vips_target_end(kakadu->target))
-			return -1;
+		if (kakadu->target) {
+			VipsKakaduSpan flush_span("target flush");
+			if (!kakadu->kakadu_target->flush() ||
+				vips_target_end(kakadu->target))
+				return -1;
+		}
+		else {
+			// hand the memory we wrote to over to the blob, no copy needed
+			size_t length;
+			void *data = kakadu->kakadu_target->steal(&length);
+
+			kakadu->blob = vips_blob_new(
+				(VipsCallbackFn) vips_area_free_cb, data, length);
+		}
 	}
 	catch (kdu_exception e) {
 		// the message has been handled already
@@ -566,8 +1051,49 @@ vips_foreign_save_kakadu_class_init(VipsForeignSaveKakaduClass *klass)
         _("Bitrate per layer"),
         VIPS_ARGUMENT_OPTIONAL_INPUT,
         G_STRUCT_OFFSET(VipsForeignSaveKakadu, rate),
-        VIPS_TYPE_ARRAY_INT);
+        VIPS_TYPE_ARRAY_DOUBLE);
+
+	VIPS_ARG_BOXED(klass, "slopes", 19,
+		_("Slopes"),
+		_("Distortion-length slope threshold per layer"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, slopes),
+		VIPS_TYPE_ARRAY_INT);
+
+	VIPS_ARG_UINT64(klass, "target_size", 20,
+		_("Target size"),
+		_("Maximum file size in bytes"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, target_size),
+		0, G_MAXINT64, 0);
 
+	VIPS_ARG_DOUBLE(klass, "size_tolerance", 21,
+		_("Size tolerance"),
+		_("Stop rate control when within this fraction of the target size"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, size_tolerance),
+		0.0, 0.5, 0.0);
+
+	VIPS_ARG_BOOL(klass, "numa", 22,
+		_("NUMA"),
+		_("Keep encode threads on one NUMA node"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, numa),
+		FALSE);
+
+	VIPS_ARG_BOXED(klass, "stats", 23,
+		_("Stats"),
+		_("Performance counters for this save"),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, stats),
+		VIPS_TYPE_ARRAY_DOUBLE);
+
+	VIPS_ARG_ENUM(klass, "preset", 24,
+		_("Preset"),
+		_("Trade encode speed against precision"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsForeignSaveKakadu, preset),
+		VIPS_TYPE_KAKADU_PRESET, VIPS_KAKADU_PRESET_BALANCED);
 }
 
 static void
@@ -576,11 +1102,13 @@ vips_foreign_save_kakadu_init(VipsForeignSaveKakadu *kakadu)
 	kakadu->tile_width = 512;
 	kakadu->tile_height = 512;
 
-	/* Chosen to give about the same filesize as regular jpg Q75.
+	/* Chosen to give about the same filesize as regular jpg Q75 when Q is
+	 * set ... unset Q means no rate control.
 	 */
 	kakadu->Q = 48;
 
 	kakadu->subsample_mode = VIPS_FOREIGN_SUBSAMPLE_OFF;
+	kakadu->preset = VIPS_KAKADU_PRESET_BALANCED;
 }
 
 typedef struct _VipsForeignSaveKakaduFile {
@@ -660,18 +1188,13 @@ vips_foreign_save_kakadu_buffer_build(VipsObject *object)
 	VipsForeignSaveKakaduBuffer *buffer =
 		(VipsForeignSaveKakaduBuffer *) object;
 
-	VipsBlob *blob;
-
-	if (!(kakadu->target = vips_target_new_to_memory()))
-		return -1;
+	// leave kakadu->target NULL to write directly to memory
 
 	if (VIPS_OBJECT_CLASS(vips_foreign_save_kakadu_buffer_parent_class)
 			->build(object))
 		return -1;
 
-	g_object_get(kakadu->target, "blob", &blob, NULL);
-	g_object_set(buffer, "buffer", blob, NULL);
-	vips_area_unref(VIPS_AREA(blob));
+	g_object_set(buffer, "buffer", kakadu->blob, NULL);
 
 	return 0;
 }
@@ -773,7 +1296,13 @@ vips_foreign_save_kakadu_target_init(VipsForeignSaveKakaduTarget *target)
  * * @tile_height: %gint for tile size
  * * @subsample_mode: #VipsForeignSubsample, chroma subsampling mode
  * * @htj2k: %gboolean, enable high-throughput jpeg2000
- * * @rate: #VipsArrayInt, bitrate per layer
+ * * @rate: #VipsArrayDouble, bitrate per layer
+ * * @slopes: #VipsArrayInt, distortion-length slope per layer
+ * * @target_size: %guint64, maximum file size in bytes
+ * * @size_tolerance: %gdouble, fractional tolerance on the target size
+ * * @numa: %gboolean, keep encode threads on one NUMA node
+ * * @preset: #VipsKakaduPreset, trade encode speed against precision
+ * * @stats: #VipsArrayDouble, output performance counters
  *
  * Write a VIPS image to a file in JPEG2000 format.
  * The saver supports 8, 16 and 32-bit int pixel
@@ -783,8 +1312,16 @@ vips_foreign_save_kakadu_target_init(VipsForeignSaveKakaduTarget *target)
  * Use @options to provide a set of Kakadu options, separated by spaces or
  * semicolons. For example `"Clayers=12;Creversible=yes;Qfactor=20"`.
  *
- * Use @Q to set the compression quality factor. The default value
- * produces file with approximately the same size as regular JPEG Q 75.
+ * Use @Q to set the compression quality factor. If you set @Q, and not
+ * @rate, @target_size or @slopes, it is mapped to a fixed
+ * distortion-length slope and the image is encoded in a single pass. Q 48
+ * gives a file of about the same size as a regular JPEG at Q 75.
+ *
+ * If you leave @Q unset, and set none of @rate, @target_size or @slopes,
+ * there is no rate control: kakadu keeps every coded bit-plane, so files
+ * are very high quality and large. Set a quantisation with `Qfactor` in
+ * @options, or set @Q, for smaller files. Setting @Q to its default value
+ * of 48 is therefore not the same as leaving it unset.
  *
  * Set @lossless to enable lossless compression.
  *
@@ -798,8 +1335,50 @@ vips_foreign_save_kakadu_target_init(VipsForeignSaveKakaduTarget *target)
  * Set @htj2k to enable high-throughput jpeg2000 compression. This option is
  * enabled automatically if a filename ending in `.jph` is detected.
  *
- * Use @rate to set the bitrate for each layer. A one-element array will set
- * the bitrate for all layers.
+ * Use @rate to set the bitrate for each layer, in bits per pixel.
+ * Rates can be fractional, and must increase from layer to layer. A 
+ * one-element array will set the bitrate for all layers. At most 32 layers
+ * are supported.
+ *
+ * Use @target_size to set the maximum size of the file in bytes, including
+ * the jp2 header. With @rate, it sets the size of the final layer and caps
+ * all earlier ones. Use @size_tolerance to let rate control stop early when
+ * it gets within this fraction below the target size, for example 0.02.
+ *
+ * Use @slopes to set a fixed distortion-length slope threshold for each
+ * layer instead. Slopes are on kakadu's logarithmic scale, must be
+ * decreasing, and each step of 256 is roughly 3dB of PSNR. Fixed slopes
+ * skip the rate control search, so encoding is faster and needs less
+ * memory, but file size is less predictable. You can't set @slopes
+ * together with @rate or @target_size.
+ *
+ * Images of more than 256 megapixels are written incrementally, so save
+ * memory doesn't grow with image area. These default to PCRL order,
+ * precincts and PLT markers, unless you set `Corder`, `Cprecincts` or
+ * `ORGgen_plt` in @options. Rate control only sees the part of the image
+ * written so far, so layer sizes are less exact.
+ *
+ * Set @numa to run kakadu's encode threads on the NUMA node of the calling
+ * thread, so their working memory stays local. This needs the plugin to be
+ * built with libnuma.
+ *
+ * Use @preset to trade encode speed against precision. The default,
+ * "balanced", matches earlier versions. "fast" lets kakadu use 16-bit
+ * arithmetic and its quickest transforms, and sets the classic block coder
+ * to bypass arithmetic coding in the lower bit-planes (unless you set
+ * `Cmodes` in @options). This encodes noticeably faster, for files a few
+ * percent larger at the same quality. "precise" works in 32-bit, which
+ * can help 16-bit images, and turns off kakadu's complexity control, so
+ * every coding pass is generated. Complexity control only skips passes
+ * that rate control would discard anyway, so this mostly costs encode time
+ * and rarely changes the file. `bench/bench.py` reports the speed, size
+ * and PSNR of each preset. @preset never turns on @htj2k, since HT files
+ * need an HT capable decoder, but HT is faster still.
+ *
+ * @stats is set to a set of performance counters for the save: bytes read,
+ * reads, seeks, bytes written, writes, stripes encoded, microseconds spent
+ * encoding stripes, kakadu threads, and peak kakadu codestream memory in
+ * bytes. Reads are always zero for save.
  *
  * This operation always writes a pyramid.
  *
@@ -836,7 +1415,13 @@ vips_kakadusave(VipsImage *in, const char *filename, ...)
  * * @tile_height: %gint for tile size
  * * @subsample_mode: #VipsForeignSubsample, chroma subsampling mode
  * * @htj2k: %gboolean, enable high-throughput jpeg2000
- * * @rate: #VipsArrayInt, bitrate per layer
+ * * @rate: #VipsArrayDouble, bitrate per layer
+ * * @slopes: #VipsArrayInt, distortion-length slope per layer
+ * * @target_size: %guint64, maximum file size in bytes
+ * * @size_tolerance: %gdouble, fractional tolerance on the target size
+ * * @numa: %gboolean, keep encode threads on one NUMA node
+ * * @preset: #VipsKakaduPreset, trade encode speed against precision
+ * * @stats: #VipsArrayDouble, output performance counters
  *
  * As vips_kakadusave(), but save to a target.
  *
@@ -887,7 +1472,13 @@ vips_kakadusave_buffer(VipsImage *in, void **buf, size_t *len, ...)
  * * @tile_height: %gint for tile size
  * * @subsample_mode: #VipsForeignSubsample, chroma subsampling mode
  * * @htj2k: %gboolean, enable high-throughput jpeg2000
- * * @rate: #VipsArrayInt, bitrate per layer
+ * * @rate: #VipsArrayDouble, bitrate per layer
+ * * @slopes: #VipsArrayInt, distortion-length slope per layer
+ * * @target_size: %guint64, maximum file size in bytes
+ * * @size_tolerance: %gdouble, fractional tolerance on the target size
+ * * @numa: %gboolean, keep encode threads on one NUMA node
+ * * @preset: #VipsKakaduPreset, trade encode speed against precision
+ * * @stats: #VipsArrayDouble, output performance counters
  *
  * As vips_kakadusave(), but save to a target.
  *
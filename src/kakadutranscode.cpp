@@ -0,0 +1,747 @@
+/* transcode and extract jpeg2000 in the compressed domain
+ */
+
+/*
+#define DEBUG
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+
+#include "kakadu.h"
+
+#include <kdu_block_coding.h>
+
+using namespace kdu_supp; // includes the core namespace
+
+typedef struct _VipsKakaduTranscode {
+	VipsOperation parent_instance;
+
+	/* Read from here, write to here.
+	 */
+	char *filename;
+	char *output;
+
+	/* Kakadu options for the output codestream.
+	 */
+	char *options;
+
+	/* Output block coder ... if unset, keep the input block coder.
+	 */
+	gboolean htj2k;
+
+	/* Keep this many quality layers, 0 for all.
+	 */
+	int layers;
+
+	/* Discard this many resolution levels, as kakaduload page.
+	 */
+	int page;
+
+	/* Extract this area (in page coordinates) ... expanded to tile
+	 * boundaries. Only set by kakaduextract.
+	 */
+	int left;
+	int top;
+	int width;
+	int height;
+
+	/* Input and output objects.
+	 */
+	VipsSource *vips_source;
+	VipsKakaduSource *kakadu_source;
+	jp2_family_src *input;
+	jpx_source *source;
+	VipsTarget *target;
+	VipsKakaduTarget *kakadu_target;
+} VipsKakaduTranscode;
+
+typedef VipsOperationClass VipsKakaduTranscodeClass;
+
+G_DEFINE_TYPE(VipsKakaduTranscode, vips_kakadutranscode, VIPS_TYPE_OPERATION);
+
+static void
+vips_kakadutranscode_dispose(GObject *gobject)
+{
+	VipsKakaduTranscode *transcode = (VipsKakaduTranscode *) gobject;
+
+#ifdef DEBUG
+	printf("vips_kakadutranscode_dispose:\n");
+#endif /*DEBUG*/
+
+	DELETE(transcode->input);
+	DELETE(transcode->source);
+	DELETE(transcode->kakadu_source);
+	DELETE(transcode->kakadu_target);
+
+	VIPS_UNREF(transcode->vips_source);
+	VIPS_UNREF(transcode->target);
+
+	G_OBJECT_CLASS(vips_kakadutranscode_parent_class)->dispose(gobject);
+}
+
+/* Copy the coding passes of a code-block unchanged. The pass slopes we read
+ * from the input mark the final pass of each quality layer, so they carry
+ * the layer structure over to the output.
+ */
+static int
+vips_kakadutranscode_copy_block(kdu_block *in, kdu_block *out)
+{
+	if (in->K_max_prime != out->K_max_prime ||
+		in->size.x != out->size.x ||
+		in->size.y != out->size.y) {
+		vips_error("kakadutranscode",
+			"%s", _("input and output code-blocks do not match"));
+		return -1;
+	}
+
+	out->missing_msbs = in->missing_msbs;
+	if (out->max_passes < in->num_passes + 2)
+		out->set_max_passes(in->num_passes + 2, false);
+	out->num_passes = in->num_passes;
+
+	int num_bytes = 0;
+	for (int z = 0; z < in->num_passes; z++) {
+		num_bytes += out->pass_lengths[z] = in->pass_lengths[z];
+		out->pass_slopes[z] = in->pass_slopes[z];
+	}
+
+	if (out->max_bytes < num_bytes)
+		out->set_max_bytes(num_bytes, false);
+	memcpy(out->byte_buffer, in->byte_buffer, num_bytes);
+
+	return 0;
+}
+
+/* The input and output block coders differ (eg. classic to HT), so we must
+ * decode to quantised samples and encode again. There's no wavelet
+ * transform and no requantisation, so this is still lossless with respect
+ * to the input codestream. Everything goes into the first quality layer.
+ */
+static int
+vips_kakadutranscode_recode_block(kdu_block *in, kdu_block *out,
+	kdu_block_decoder &decoder, kdu_block_encoder &encoder)
+{
+	if (in->K_max_prime != out->K_max_prime ||
+		in->size.x != out->size.x ||
+		in->size.y != out->size.y) {
+		vips_error("kakadutranscode",
+			"%s", _("input and output code-blocks do not match"));
+		return -1;
+	}
+
+	// samples are processed in stripes of four rows
+	int num_samples = (((in->size.y + 3) >> 2) << 2) * in->size.x;
+
+	if (in->max_samples < num_samples)
+		in->set_max_samples(num_samples);
+	decoder.decode(in);
+
+	if (out->max_samples < num_samples)
+		out->set_max_samples(num_samples);
+	memcpy(out->sample_buffer, in->sample_buffer,
+		num_samples * sizeof(kdu_int32));
+	encoder.encode(out);
+
+	for (int z = 0; z < out->num_passes; z++)
+		out->pass_slopes[z] = z == out->num_passes - 1 ? 0xFFFF : 0;
+
+	return 0;
+}
+
+static int
+vips_kakadutranscode_tile(kdu_tile tile_in, kdu_tile tile_out)
+{
+	kdu_block_decoder decoder;
+	kdu_block_encoder encoder;
+
+	int num_components = tile_out.get_num_components();
+	for (int c = 0; c < num_components; c++) {
+		kdu_tile_comp comp_in = tile_in.access_component(c);
+		kdu_tile_comp comp_out = tile_out.access_component(c);
+
+		int num_resolutions = comp_out.get_num_resolutions();
+		for (int r = 0; r < num_resolutions; r++) {
+			kdu_resolution res_in = comp_in.access_resolution(r);
+			kdu_resolution res_out = comp_out.access_resolution(r);
+
+			int min_band;
+			int num_bands = res_out.get_valid_band_indices(min_band);
+			for (int b = min_band; b < min_band + num_bands; b++) {
+				kdu_subband band_in = res_in.access_subband(b);
+				kdu_subband band_out = res_out.access_subband(b);
+
+				kdu_dims blocks_in;
+				kdu_dims blocks_out;
+				band_in.get_valid_blocks(blocks_in);
+				band_out.get_valid_blocks(blocks_out);
+				if (blocks_in.size.x != blocks_out.size.x ||
+					blocks_in.size.y != blocks_out.size.y) {
+					vips_error("kakadutranscode",
+						"%s", _("input and output code-blocks do not match"));
+					return -1;
+				}
+
+				kdu_coords idx;
+				for (idx.y = 0; idx.y < blocks_out.size.y; idx.y++)
+					for (idx.x = 0; idx.x < blocks_out.size.x; idx.x++) {
+						kdu_block *in = band_in.open_block(idx + blocks_in.pos);
+						kdu_block *out =
+							band_out.open_block(idx + blocks_out.pos);
+
+						int result = in->modes == out->modes ?
+							vips_kakadutranscode_copy_block(in, out) :
+							vips_kakadutranscode_recode_block(in, out,
+								decoder, encoder);
+
+						band_in.close_block(in);
+						band_out.close_block(out);
+
+						if (result)
+							return -1;
+					}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Copy tiles_in from in to all tiles of out. valid_tiles in out must be the
+ * same shape as tiles_in, but can be offset.
+ */
+static int
+vips_kakadutranscode_codestream(kdu_codestream codestream_in,
+	kdu_dims tiles_in, kdu_codestream codestream_out)
+{
+	kdu_dims tiles_out;
+	codestream_out.get_valid_tiles(tiles_out);
+	if (tiles_in.size.x != tiles_out.size.x ||
+		tiles_in.size.y != tiles_out.size.y) {
+		vips_error("kakadutranscode",
+			"%s", _("input and output tiles do not match"));
+		return -1;
+	}
+
+	kdu_coords idx;
+	for (idx.y = 0; idx.y < tiles_out.size.y; idx.y++)
+		for (idx.x = 0; idx.x < tiles_out.size.x; idx.x++) {
+			kdu_tile tile_in = codestream_in.open_tile(idx + tiles_in.pos);
+			kdu_tile tile_out = codestream_out.open_tile(idx + tiles_out.pos);
+
+			int result = vips_kakadutranscode_tile(tile_in, tile_out);
+
+			tile_in.close();
+			tile_out.close();
+
+			if (result)
+				return -1;
+		}
+
+	return 0;
+}
+
+/* Expand the extract area to tile boundaries. siz has the input image
+ * structure after discarding levels. Set canvas and partition to the output
+ * image area and tile partition on the canvas, and tiles to the input tile
+ * indexes we need.
+ */
+static int
+vips_kakadutranscode_area(VipsKakaduTranscode *transcode, siz_params *siz,
+	kdu_dims &canvas, kdu_dims &partition, kdu_dims &tiles)
+{
+	kdu_coords origin, extent;
+	siz->get(Sorigin, 0, 0, origin.y);
+	siz->get(Sorigin, 0, 1, origin.x);
+	siz->get(Ssize, 0, 0, extent.y);
+	siz->get(Ssize, 0, 1, extent.x);
+	siz->get(Stile_origin, 0, 0, partition.pos.y);
+	siz->get(Stile_origin, 0, 1, partition.pos.x);
+	siz->get(Stiles, 0, 0, partition.size.y);
+	siz->get(Stiles, 0, 1, partition.size.x);
+
+	VipsRect image = { 0, 0, extent.x - origin.x, extent.y - origin.y };
+	VipsRect area = { transcode->left, transcode->top,
+		transcode->width, transcode->height };
+	if (vips_rect_isempty(&area) ||
+		!vips_rect_includesrect(&image, &area)) {
+		vips_error("kakaduextract", "%s", _("bad extract area"));
+		return -1;
+	}
+
+	// the first and last tiles the area touches
+	kdu_coords first, last;
+	first.x = (origin.x + area.left - partition.pos.x) / partition.size.x;
+	first.y = (origin.y + area.top - partition.pos.y) / partition.size.y;
+	last.x = (origin.x + VIPS_RECT_RIGHT(&area) - 1 - partition.pos.x) /
+		partition.size.x;
+	last.y = (origin.y + VIPS_RECT_BOTTOM(&area) - 1 - partition.pos.y) /
+		partition.size.y;
+
+	tiles.pos = first;
+	tiles.size.x = last.x - first.x + 1;
+	tiles.size.y = last.y - first.y + 1;
+
+	// move the tile origin to the first tile we keep, so the tile
+	// boundaries (and all code-block boundaries) stay in the same place
+	// on the canvas
+	partition.pos.x += first.x * partition.size.x;
+	partition.pos.y += first.y * partition.size.y;
+
+	int right = partition.pos.x + tiles.size.x * partition.size.x;
+	int bottom = partition.pos.y + tiles.size.y * partition.size.y;
+	canvas.pos.x = VIPS_MAX(origin.x, partition.pos.x);
+	canvas.pos.y = VIPS_MAX(origin.y, partition.pos.y);
+	canvas.size.x = VIPS_MIN(extent.x, right) - canvas.pos.x;
+	canvas.size.y = VIPS_MIN(extent.y, bottom) - canvas.pos.y;
+
+#ifdef DEBUG
+	printf("vips_kakadutranscode_area: tiles %d x %d at %d, %d\n",
+		tiles.size.x, tiles.size.y, tiles.pos.x, tiles.pos.y);
+	printf("    canvas %d x %d at %d, %d\n",
+		canvas.size.x, canvas.size.y, canvas.pos.x, canvas.pos.y);
+#endif /*DEBUG*/
+
+	return 0;
+}
+
+static void
+vips_kakadutranscode_set_area(siz_params *siz,
+	kdu_dims &canvas, kdu_dims &partition)
+{
+	siz->set(Sorigin, 0, 0, canvas.pos.y);
+	siz->set(Sorigin, 0, 1, canvas.pos.x);
+	siz->set(Ssize, 0, 0, canvas.pos.y + canvas.size.y);
+	siz->set(Ssize, 0, 1, canvas.pos.x + canvas.size.x);
+	siz->set(Stile_origin, 0, 0, partition.pos.y);
+	siz->set(Stile_origin, 0, 1, partition.pos.x);
+}
+
+/* Any kakadu method can throw a kdu_exception, our caller must catch these.
+ */
+static int
+vips_kakadutranscode_write(VipsKakaduTranscode *transcode,
+	kdu_codestream &codestream_in, kdu_codestream &codestream_out)
+{
+	VipsObject *object = VIPS_OBJECT(transcode);
+	VipsObjectClass *klass = VIPS_OBJECT_GET_CLASS(object);
+
+	transcode->input->open(transcode->kakadu_source);
+	if (transcode->source->open(transcode->input, true) <= 0) {
+		vips_error(klass->nickname,
+			"%s", _("raw codec transcode not implemented"));
+		return -1;
+	}
+
+	jpx_layer_source layer = transcode->source->access_layer(0);
+	jpx_codestream_source codestream_source =
+		transcode->source->access_codestream(0);
+
+	codestream_in.create(codestream_source.open_stream());
+	siz_params *siz_in = codestream_in.access_siz();
+
+	int in_modes = 0;
+	siz_in->access_cluster(COD_params)->get(Cmodes, 0, 0, in_modes);
+
+	int in_levels = 0;
+	siz_in->access_cluster(COD_params)->get(Clevels, 0, 0, in_levels);
+	if (transcode->page > in_levels) {
+		vips_error(klass->nickname,
+			_("page should be no more than %d"), in_levels);
+		return -1;
+	}
+
+	codestream_in.apply_input_restrictions(0, 0, transcode->page,
+		transcode->layers, NULL, KDU_WANT_CODESTREAM_COMPONENTS);
+
+	gboolean htj2k =
+		vips_object_argument_isset(object, "htj2k") ?
+			transcode->htj2k :
+			(in_modes & Cmodes_HT) != 0;
+
+	// the output SIZ is a copy of the input at this page, with the
+	// capabilities changed for the output block coder
+	siz_params siz;
+	siz.copy_from(siz_in, -1, -1, -1, 0, transcode->page,
+		false, false, false);
+	int caps = 0;
+	siz.get(Scap, 0, 0, caps);
+	siz.set(Scap, 0, 0, htj2k ? caps | Scap_P15 : caps & ~Scap_P15);
+
+	// we copy whole tiles, so an extract area is expanded to tile
+	// boundaries
+	kdu_dims tiles;
+	kdu_dims canvas;
+	kdu_dims partition;
+	// only kakaduextract sets width
+	gboolean extract = transcode->width > 0;
+	if (extract) {
+		if (vips_kakadutranscode_area(transcode, &siz,
+				canvas, partition, tiles))
+			return -1;
+		vips_kakadutranscode_set_area(&siz, canvas, partition);
+	}
+	else
+		codestream_in.get_valid_tiles(tiles);
+
+	kdu_params *siz_ref = &siz;
+	siz_ref->finalize();
+
+	transcode->kakadu_target->open(transcode->target);
+
+	jp2_family_tgt family;
+	family.open(transcode->kakadu_target);
+
+	jp2_target output;
+	output.open(&family);
+
+	// copy the jp2 header
+	output.access_dimensions().init(&siz);
+	output.access_colour().copy(layer.access_colour(0));
+	output.access_resolution().copy(layer.access_resolution());
+	for (int for_display = 0; for_display < 2; for_display++) {
+		float resolution =
+			layer.access_resolution().get_resolution(for_display);
+
+		if (resolution > 0)
+			output.access_resolution().set_resolution(
+				resolution / (1 << transcode->page), for_display);
+	}
+	output.access_palette().copy(codestream_source.access_palette());
+	output.access_channels().copy(layer.access_channels());
+
+	codestream_out.create(&siz, &output);
+
+	// and all the coding parameters
+	siz_params *siz_out = codestream_out.access_siz();
+	siz_out->copy_all(siz_in, 0, transcode->page);
+	siz_out->set(Scap, 0, 0, htj2k ? caps | Scap_P15 : caps & ~Scap_P15);
+	if (extract)
+		vips_kakadutranscode_set_area(siz_out, canvas, partition);
+
+	kdu_params *cod_out = siz_out->access_cluster(COD_params);
+	cod_out->set(Cmodes, 0, 0,
+		htj2k ? in_modes | Cmodes_HT : in_modes & ~Cmodes_HT);
+
+	int in_layers = 1;
+	cod_out->get(Clayers, 0, 0, in_layers);
+	int layers = transcode->layers > 0 ?
+		VIPS_MIN(transcode->layers, in_layers) : in_layers;
+
+	// changing block coder means we can't keep the layer structure
+	if ((in_modes & Cmodes_HT) != (htj2k ? Cmodes_HT : 0))
+		layers = 1;
+	cod_out->set(Clayers, 0, 0, layers);
+
+	if (vips_object_argument_isset(object, "options")) {
+		g_autofree char *options = g_strdup(transcode->options);
+
+		char *p, *q;
+
+		for (p = options; (q = vips_break_token(p, "; ")); p = q)
+			if (!siz_out->parse_string(p)) {
+				vips_error(klass->nickname,
+					_("unable to set option %s"), p);
+				return -1;
+			}
+	}
+
+	siz_out->finalize_all();
+	cod_out->get(Clayers, 0, 0, layers);
+
+	output.write_header();
+	output.open_codestream(true);
+
+	if (vips_kakadutranscode_codestream(codestream_in, tiles,
+			codestream_out))
+		return -1;
+
+	// pass slopes on copied blocks are 0xFFFF - layer index, so these
+	// thresholds reproduce the input layers
+	std::vector<kdu_long> layer_bytes(layers, 0);
+	std::vector<kdu_uint16> layer_thresholds(layers);
+	for (int i = 0; i < layers; i++)
+		layer_thresholds[i] = 0xFFFF - i;
+
+	codestream_out.flush(layer_bytes.data(), layers,
+		layer_thresholds.data(), true, true);
+
+	codestream_out.destroy();
+	codestream_in.destroy();
+	output.close();
+
+	if (!transcode->kakadu_target->flush() ||
+		vips_target_end(transcode->target))
+		return -1;
+
+	return 0;
+}
+
+static int
+vips_kakadutranscode_build(VipsObject *object)
+{
+	VipsKakaduTranscode *transcode = (VipsKakaduTranscode *) object;
+
+#ifdef DEBUG
+	printf("vips_kakadutranscode_build:\n");
+#endif /*DEBUG*/
+
+	if (VIPS_OBJECT_CLASS(vips_kakadutranscode_parent_class)->build(object))
+		return -1;
+
+	if (!(transcode->vips_source =
+		vips_source_new_from_file(transcode->filename)))
+		return -1;
+	if (!(transcode->target = vips_target_new_to_file(transcode->output)))
+		return -1;
+
+	transcode->kakadu_source = new VipsKakaduSource(transcode->vips_source);
+	transcode->input = new jp2_family_src();
+	transcode->source = new jpx_source();
+	transcode->kakadu_target = new VipsKakaduTarget();
+
+	kdu_codestream codestream_in;
+	kdu_codestream codestream_out;
+
+	int result;
+
+	try {
+		result = vips_kakadutranscode_write(transcode,
+			codestream_in, codestream_out);
+	}
+	catch (kdu_exception e) {
+		// the message has been handled already
+		result = -1;
+	}
+
+	if (codestream_out.exists())
+		codestream_out.destroy();
+	if (codestream_in.exists())
+		codestream_in.destroy();
+
+	return result;
+}
+
+static void
+vips_kakadutranscode_class_init(VipsKakaduTranscodeClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	VipsObjectClass *object_class = (VipsObjectClass *) klass;
+	VipsOperationClass *operation_class = VIPS_OPERATION_CLASS(klass);
+
+	gobject_class->dispose = vips_kakadutranscode_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "kakadutranscode";
+	object_class->description =
+		_("transcode JPEG2000 image in the compressed domain");
+	object_class->build = vips_kakadutranscode_build;
+
+	// this writes a file, so it can't be cached
+	operation_class->flags = VIPS_OPERATION_NOCACHE;
+
+	VIPS_ARG_STRING(klass, "filename", 1,
+		_("Filename"),
+		_("Filename to load from"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, filename),
+		NULL);
+
+	VIPS_ARG_STRING(klass, "output", 2,
+		_("Output"),
+		_("Filename to save to"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, output),
+		NULL);
+
+	VIPS_ARG_STRING(klass, "options", 11,
+		_("Options"),
+		_("Set of Kakadu option specifications"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, options),
+		NULL);
+
+	VIPS_ARG_BOOL(klass, "htj2k", 12,
+		_("High-throughput"),
+		_("Output high-throughput jp2k"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, htj2k),
+		FALSE);
+
+	VIPS_ARG_INT(klass, "layers", 13,
+		_("Layers"),
+		_("Number of quality layers to keep, 0 for all"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, layers),
+		0, 16384, 0);
+
+	VIPS_ARG_INT(klass, "page", 14,
+		_("Page"),
+		_("Resolution level to keep, as kakaduload page"),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, page),
+		0, 32, 0);
+}
+
+static void
+vips_kakadutranscode_init(VipsKakaduTranscode *transcode)
+{
+}
+
+/**
+ * vips_kakadutranscode:
+ * @filename: file to read from
+ * @output: file to write to
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @options: %gchararray, set of Kakadu options
+ * * @htj2k: %gboolean, output high-throughput jpeg2000
+ * * @layers: %gint, number of quality layers to keep
+ * * @page: %gint, resolution level to keep
+ *
+ * Transcode a JPEG2000 image without decompressing it. Code-blocks are
+ * copied from @filename to @output, so this runs at about the speed of
+ * file IO.
+ *
+ * Use @htj2k to switch between classic and high-throughput block coding.
+ * If it's not set, the input block coder is kept. Changing the block coder
+ * needs each code-block to be decoded and encoded again, but there is no
+ * wavelet transform, and the result is lossless with respect to the input.
+ * The output will have a single quality layer.
+ *
+ * Use @layers to keep only the first few quality layers of the input.
+ *
+ * Use @page to keep only the lower resolution levels of the input. @page 1
+ * will be half the size of the input, exactly as vips_kakaduload() with
+ * @page set.
+ *
+ * Use @options to set output codestream options, such as progression order
+ * and markers, for example `"Corder=RPCL ORGgen_plt=yes ORGgen_tlm=8"`.
+ * Options which change the image structure (eg. tile size, code-block size
+ * or number of levels) can't be used.
+ *
+ * See also: vips_kakaduextract(), vips_kakadusave(), vips_kakaduload().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_kakadutranscode(const char *filename, const char *output, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, output);
+	result = vips_call_split("kakadutranscode", ap, filename, output);
+	va_end(ap);
+
+	return result;
+}
+
+typedef VipsKakaduTranscode VipsKakaduExtract;
+typedef VipsKakaduTranscodeClass VipsKakaduExtractClass;
+
+G_DEFINE_TYPE(VipsKakaduExtract, vips_kakaduextract,
+	vips_kakadutranscode_get_type());
+
+static void
+vips_kakaduextract_class_init(VipsKakaduExtractClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	VipsObjectClass *object_class = (VipsObjectClass *) klass;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "kakaduextract";
+	object_class->description =
+		_("extract area of JPEG2000 image in the compressed domain");
+
+	VIPS_ARG_INT(klass, "left", 3,
+		_("Left"),
+		_("Left edge of extract area"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, left),
+		0, VIPS_MAX_COORD, 0);
+
+	VIPS_ARG_INT(klass, "top", 4,
+		_("Top"),
+		_("Top edge of extract area"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, top),
+		0, VIPS_MAX_COORD, 0);
+
+	VIPS_ARG_INT(klass, "width", 5,
+		_("Width"),
+		_("Width of extract area"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, width),
+		1, VIPS_MAX_COORD, 1);
+
+	VIPS_ARG_INT(klass, "height", 6,
+		_("Height"),
+		_("Height of extract area"),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET(VipsKakaduTranscode, height),
+		1, VIPS_MAX_COORD, 1);
+}
+
+static void
+vips_kakaduextract_init(VipsKakaduExtract *extract)
+{
+}
+
+/**
+ * vips_kakaduextract:
+ * @filename: file to read from
+ * @output: file to write to
+ * @left: left edge of area to extract
+ * @top: top edge of area to extract
+ * @width: width of area to extract
+ * @height: height of area to extract
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @options: %gchararray, set of Kakadu options
+ * * @htj2k: %gboolean, output high-throughput jpeg2000
+ * * @layers: %gint, number of quality layers to keep
+ * * @page: %gint, resolution level to keep
+ *
+ * Extract an area of a JPEG2000 image without decompressing it. Whole tiles
+ * are copied from @filename to @output, so the area is expanded to the
+ * enclosing tile boundaries. The tile and code-block structure is kept, so
+ * the output pixels are identical to the matching input pixels, even for
+ * lossy images.
+ *
+ * The area is given in the coordinates of @page, so use vips_kakaduload()
+ * with the same @page to find the area you need.
+ *
+ * Untiled images can only be extracted as a whole, though you can still use
+ * @page to get a reduced resolution.
+ *
+ * See vips_kakadutranscode() for a description of the optional arguments.
+ *
+ * See also: vips_kakadutranscode(), vips_kakaduload().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_kakaduextract(const char *filename, const char *output,
+	int left, int top, int width, int height, ...)
+{
+	va_list ap;
+	int result;
+
+	va_start(ap, height);
+	result = vips_call_split("kakaduextract", ap, filename, output,
+		left, top, width, height);
+	va_end(ap);
+
+	return result;
+}
@@ -0,0 +1,50 @@
+# vim: set fileencoding=utf-8 :
+
+import sys
+import os
+import shutil
+import tempfile
+import pytest
+
+import pyvips
+from helpers import *
+
+class TestKakaduDzsave:
+    tempdir = None
+
+    @classmethod
+    def setup_class(cls):
+        cls.tempdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        shutil.rmtree(cls.tempdir, ignore_errors=True)
+
+    def test_kakadudzsave(self):
+        image = pyvips.Image.kakaduload(JP2K_FILE)
+
+        name1 = os.path.join(self.tempdir, "kakadu")
+        pyvips.Operation.call("kakadudzsave", JP2K_FILE, name1,
+                              suffix=".png")
+        name2 = os.path.join(self.tempdir, "vips")
+        image.dzsave(name2, suffix=".png")
+
+        # the same layout as dzsave
+        assert os.path.isfile(name1 + ".dzi")
+        levels1 = sorted(os.listdir(name1 + "_files"), key=int)
+        levels2 = sorted(os.listdir(name2 + "_files"), key=int)
+        assert levels1 == levels2
+        for level in levels2:
+            tiles1 = sorted(os.listdir(os.path.join(name1 + "_files", level)))
+            tiles2 = sorted(os.listdir(os.path.join(name2 + "_files", level)))
+            assert tiles1 == tiles2
+
+        # and the same tiles, apart from the filter used to reduce
+        for level in levels2[-3:]:
+            tile1 = pyvips.Image.new_from_file(
+                os.path.join(name1 + "_files", level, "0_0.png"))
+            tile2 = pyvips.Image.new_from_file(
+                os.path.join(name2 + "_files", level, "0_0.png"))
+            assert tile1.width == tile2.width
+            assert tile1.height == tile2.height
+            assert abs(tile1.avg() - tile2.avg()) < 5
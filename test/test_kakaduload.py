@@ -2,8 +2,12 @@
 
 import sys
 import os
+import json
 import shutil
+import struct
+import subprocess
 import tempfile
+import time
 import pytest
 
 import pyvips
@@ -29,6 +33,15 @@ class TestKakaduLoad:
         assert image.format == image_file.format
         assert (image - image_file).abs().max() < 10
 
+    def tiled_file(self):
+        # 256 codestream tiles of 64x64, with noise so each tile has plenty
+        # of compressed data
+        filename = temp_filename(self.tempdir, ".jp2")
+        noise = pyvips.Image.gaussnoise(1024, 1024, sigma=64, mean=128)
+        noise.cast("uchar").kakadusave(filename, lossless=True,
+                                       options="Stiles={64,64}")
+        return filename
+
     @skip_if_no("jp2kload")
     def test_kakaduload_file(self):
         image = pyvips.Image.kakaduload(JP2K_FILE)
@@ -64,3 +77,347 @@ class TestKakaduLoad:
         image = pyvips.Image.kakaduload(JP2K_RESOLUTION_FILE)
         assert abs(image.xres - 11.8) < 0.1
         assert abs(image.yres - 11.8) < 0.1
+
+    def test_kakaduload_numa(self):
+        # numa only changes thread placement, never pixels ... without
+        # libnuma, it does nothing
+        image1 = pyvips.Image.kakaduload(JP2K_FILE)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, numa=True)
+        assert (image1 - image2).abs().max() == 0
+
+    def test_kakaduload_stats(self):
+        image = pyvips.Image.kakaduload(JP2K_FILE)
+        image.avg()
+
+        # bytes read, reads, seeks, bytes written, writes, tiles,
+        # process usec, threads, memory
+        stats = image.get("kakadu-stats")
+        assert len(stats) == 9
+        assert stats[0] > 0
+        assert stats[1] > 0
+        assert stats[4] == 0
+        assert stats[5] > 0
+        assert stats[7] >= 1
+
+    def test_kakaduload_trace(self):
+        # tracing is set up on plugin load, so we need a new process
+        filename = temp_filename(self.tempdir, ".json")
+        env = dict(os.environ, VIPS_KAKADU_TRACE=filename)
+        code = "import sys, pyvips; " \
+               "pyvips.Image.kakaduload(sys.argv[1], small_threshold=0).avg()"
+        subprocess.run([sys.executable, "-c", code, JP2K_FILE],
+                       env=env, check=True)
+
+        with open(filename) as f:
+            trace = json.load(f)
+        names = [event["name"] for event in trace["traceEvents"]]
+        assert "header" in names
+        assert "tilecache miss" in names
+        assert "decompressor process" in names
+
+    def test_kakaduload_block_size(self):
+        image1 = pyvips.Image.kakaduload(JP2K_FILE, block_size=0)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, block_size=1024)
+        image3 = pyvips.Image.kakaduload(JP2K_FILE)
+        assert (image1 - image2).abs().max() == 0
+        assert (image1 - image3).abs().max() == 0
+
+        # the block cache should coalesce kakadu's small reads
+        reads1 = image1.get("kakadu-stats")[1]
+        reads3 = image3.get("kakadu-stats")[1]
+        assert reads3 < reads1
+
+    def test_kakaduload_block_size_large(self):
+        # blocks larger than the source cache, so readahead must not evict
+        # the block it's fetching
+        filename = temp_filename(self.tempdir, ".jp2")
+        noise = pyvips.Image.gaussnoise(2048, 2048, sigma=64, mean=128)
+        noise.cast("uchar").kakadusave(filename, lossless=True,
+                                       options="Stiles={512,512}")
+
+        image1 = pyvips.Image.kakaduload(filename, block_size=0,
+                                         small_threshold=0)
+        image2 = pyvips.Image.kakaduload(filename, block_size=1048576,
+                                         small_threshold=0)
+        assert (image1 - image2).abs().max() == 0
+
+    def test_kakaduload_prefetch(self):
+        # prefetch only changes what's in the tile cache, never pixels
+        image1 = pyvips.Image.kakaduload(JP2K_FILE, small_threshold=0)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, prefetch=8,
+                                         small_threshold=0)
+        assert (image1 - image2).abs().max() == 0
+
+        # closing an image with prefetches queued must be safe
+        image = pyvips.Image.kakaduload(JP2K_FILE, prefetch=8,
+                                        small_threshold=0)
+        image.crop(0, 0, 16, 16).avg()
+        image = None
+
+        def tiles(image):
+            return image.get("kakadu-stats")[5]
+
+        # without prefetch, reading the next tile must decode it
+        filename = self.tiled_file()
+        image = pyvips.Image.kakaduload(filename, small_threshold=0)
+        image.crop(0, 0, 16, 16).avg()
+        assert tiles(image) == 1
+        image.crop(64, 0, 16, 16).avg()
+        assert tiles(image) == 2
+
+        # with prefetch, the three neighbours of the corner tile are
+        # decoded in the background, so the next tile is a hit
+        image = pyvips.Image.kakaduload(filename, prefetch=8,
+                                        small_threshold=0)
+        image.crop(0, 0, 16, 16).avg()
+        for i in range(100):
+            if tiles(image) == 4:
+                break
+            time.sleep(0.1)
+        assert tiles(image) == 4
+        image.crop(64, 0, 16, 16).avg()
+        assert tiles(image) == 4
+
+    def test_kakaduload_cache_bytes(self):
+        image1 = pyvips.Image.kakaduload(JP2K_FILE, small_threshold=0)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, cache_bytes=0,
+                                         small_threshold=0)
+        assert (image1 - image2).abs().max() == 0
+
+        # with no cache, every pass over the image must decode again
+        image2.avg()
+        tiles = image2.get("kakadu-stats")[5]
+        image2.max()
+        assert image2.get("kakadu-stats")[5] > tiles
+
+    def test_kakaduload_shared_cache(self):
+        def load():
+            source = pyvips.Source.new_from_file(JP2K_FILE)
+            image = pyvips.Image.kakaduload_source(source, shared_cache=True)
+            image.avg()
+            return image
+
+        # the second load should find every block in the shared cache
+        image1 = load()
+        image2 = load()
+        assert (image1 - image2).abs().max() == 0
+        assert image2.get("kakadu-stats")[0] == 0
+
+    def test_kakaduload_shared_cache_block_size(self):
+        # blocks of different sizes must not be mixed up in the shared cache
+        def load(block_size):
+            source = pyvips.Source.new_from_file(JP2K_FILE)
+            image = pyvips.Image.kakaduload_source(source, shared_cache=True,
+                                                   block_size=block_size)
+            return image.copy_memory()
+
+        image1 = load(4096)
+        image2 = load(16384)
+        image3 = pyvips.Image.kakaduload(JP2K_FILE, block_size=0)
+        assert (image1 - image3).abs().max() == 0
+        assert (image2 - image3).abs().max() == 0
+
+    def test_kakaduload_shared_tiles(self):
+        # the tile cache is set up on plugin load, so we need new processes
+        tile_cache = os.path.join(self.tempdir, "tiles")
+        env = dict(os.environ, VIPS_KAKADU_TILE_CACHE=tile_cache)
+        code = "import sys, pyvips; " \
+               "image = pyvips.Image.kakaduload(sys.argv[1], " \
+               "small_threshold=int(sys.argv[2])); " \
+               "print(image.avg()); " \
+               "print(image.get('kakadu-stats')[5])"
+
+        def run(small_threshold=2048 * 2048):
+            output = subprocess.run([sys.executable, "-c", code, JP2K_FILE,
+                                     str(small_threshold)],
+                                    env=env, check=True,
+                                    stdout=subprocess.PIPE).stdout
+            avg, tiles = output.decode().split()
+            return float(avg), float(tiles)
+
+        avg1, tiles1 = run()
+        assert tiles1 > 0
+        assert len(os.listdir(tile_cache)) > 0
+
+        # the second process finds every tile in the shared cache
+        avg2, tiles2 = run()
+        assert avg1 == avg2
+        assert tiles2 == 0
+
+        # the tile path must not pick up pixels from the single-pass decode,
+        # even where a tile covers the whole image
+        avg3, tiles3 = run(small_threshold=0)
+        assert tiles3 > 0
+
+    def test_kakaduload_cache_threshold(self):
+        # a full pass over many tiles, so a persistent codestream builds up
+        # parsed state unless kakadu can unload it
+        filename = self.tiled_file()
+        image1 = pyvips.Image.kakaduload(filename, small_threshold=0)
+        image2 = pyvips.Image.kakaduload(filename, small_threshold=0,
+                                         cache_threshold=65536)
+        assert (image1 - image2).abs().max() == 0
+
+        # peak codestream memory
+        memory1 = image1.get("kakadu-stats")[8]
+        memory2 = image2.get("kakadu-stats")[8]
+        assert memory2 > 0
+        assert memory2 < memory1
+
+    def test_kakaduload_small_threshold(self):
+        # the single-pass decode must match the tile path
+        for page in [0, 1]:
+            image1 = pyvips.Image.kakaduload(JP2K_FILE, page=page)
+            image2 = pyvips.Image.kakaduload(JP2K_FILE, page=page,
+                                             small_threshold=0)
+            assert image1.width == image2.width
+            assert image1.height == image2.height
+            assert (image1 - image2).abs().max() < 2
+
+        # and decode just once
+        image1.avg()
+        image1.max()
+        assert image1.get("kakadu-stats")[5] == 1
+
+    def test_kakaduload_srgb(self):
+        image1 = pyvips.Image.kakaduload(JP2K_FILE)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, srgb=True)
+        assert image2.interpretation == "srgb"
+        assert image2.get_typeof("icc-profile-data") == 0
+        assert image1.width == image2.width
+        assert image1.height == image2.height
+        assert abs(image1.avg() - image2.avg()) < 5
+
+    @skip_if_no("icc_transform")
+    def test_kakaduload_srgb_icc(self):
+        # a lossless file tagged with a P3 profile, so conversion to sRGB
+        # must change the pixels
+        filename = temp_filename(self.tempdir, ".jp2")
+        p3 = self.ppm.icc_transform("p3")
+        p3.kakadusave(filename, lossless=True)
+
+        # by default, we get the stored pixels and the profile, on both the
+        # single-pass and the tile path
+        for threshold in [0, 100000000]:
+            image = pyvips.Image.kakaduload(filename,
+                                            small_threshold=threshold)
+            assert image.interpretation == "srgb"
+            assert image.get_typeof("icc-profile-data") != 0
+            assert (image - p3).abs().max() == 0
+
+        # with srgb, kakadu converts, and the profile goes
+        image = pyvips.Image.kakaduload(filename, srgb=True)
+        assert image.interpretation == "srgb"
+        assert image.get_typeof("icc-profile-data") == 0
+        expected = p3.icc_transform("srgb")
+        assert (image - expected).abs().avg() < (image - p3).abs().avg()
+        assert (image - expected).abs().avg() < 2
+
+    def palette_file(self, index, palette):
+        # kakadusave can't write palettes, so save the index, then add pclr
+        # and cmap boxes to the jp2 header and tag it as sRGB
+        def parse(data):
+            boxes = []
+            pos = 0
+            while pos < len(data):
+                length, kind = struct.unpack(">I4s", data[pos:pos + 8])
+                header = 8
+                if length == 1:
+                    length = struct.unpack(">Q", data[pos + 8:pos + 16])[0]
+                    header = 16
+                elif length == 0:
+                    length = len(data) - pos
+                boxes.append((kind, data[pos + header:pos + length]))
+                pos += length
+            return boxes
+
+        def box(kind, payload):
+            return struct.pack(">I4s", 8 + len(payload), kind) + payload
+
+        n_entries = palette.width
+        n_colours = palette.bands
+        pclr = struct.pack(">HB", n_entries, n_colours) + \
+            bytes([7] * n_colours) + palette.write_to_memory()
+        cmap = b"".join(struct.pack(">HBB", 0, 1, i)
+                        for i in range(n_colours))
+        colr = struct.pack(">BBBI", 1, 0, 0, 16)
+
+        data = index.kakadusave_buffer(lossless=True)
+        jp2 = b""
+        for kind, payload in parse(data):
+            if kind == b"jp2h":
+                header = b""
+                for sub_kind, sub_payload in parse(payload):
+                    if sub_kind == b"colr":
+                        sub_payload = colr
+                    header += box(sub_kind, sub_payload)
+                    if sub_kind == b"ihdr":
+                        header += box(b"pclr", pclr) + box(b"cmap", cmap)
+                payload = header
+            jp2 += box(kind, payload)
+
+        filename = temp_filename(self.tempdir, ".jp2")
+        with open(filename, "wb") as f:
+            f.write(jp2)
+        return filename
+
+    def test_kakaduload_indexed(self):
+        # indexed has no effect on images without a palette
+        image1 = pyvips.Image.kakaduload(JP2K_FILE)
+        image2 = pyvips.Image.kakaduload(JP2K_FILE, indexed=True)
+        assert image2.get_typeof("kakadu-palette") == 0
+        assert image1.bands == image2.bands
+        assert (image1 - image2).abs().max() == 0
+
+        # a 256 colour palette image
+        index = self.ppm[0].copy_memory()
+        entries = [[i, 255 - i, (i * 7) & 255] for i in range(256)]
+        palette = pyvips.Image.new_from_memory(bytes(sum(entries, [])),
+                                               256, 1, 3, "uchar")
+        filename = self.palette_file(index, palette)
+
+        # normally expanded to a band per colour
+        expanded = pyvips.Image.kakaduload(filename)
+        assert expanded.bands == 3
+        assert expanded.format == "uchar"
+        assert expanded.interpretation == "srgb"
+        assert (expanded - index.maplut(palette)).abs().max() == 0
+
+        # with indexed, the unscaled index and the palette, which maplut
+        # expands to the same pixels
+        image = pyvips.Image.kakaduload(filename, indexed=True)
+        assert image.bands == 1
+        assert image.format == "uchar"
+        assert (image - index).abs().max() == 0
+        loaded_palette = image.get("kakadu-palette")
+        assert loaded_palette.width == 256
+        assert loaded_palette.bands == 3
+        assert (loaded_palette - palette).abs().max() == 0
+        assert (image.maplut(loaded_palette) - expanded).abs().max() == 0
+
+    def test_kakaduload_preset(self):
+        image1 = pyvips.Image.kakaduload(JP2K_FILE, preset="precise")
+        for preset in ["fast", "balanced"]:
+            # the tile path, and the single-pass path
+            for threshold in [0, 100000000]:
+                image2 = pyvips.Image.kakaduload(JP2K_FILE, preset=preset,
+                                                 small_threshold=threshold)
+                assert (image1 - image2).abs().max() < 4
+
+    def test_kakaduload_auto_layers(self):
+        filename = temp_filename(self.tempdir, ".jp2")
+        self.ppm.kakadusave(filename, rate=[0.25, 0.5, 1, 2, 4, 8])
+
+        image = pyvips.Image.kakaduload(filename, layers=2)
+        assert image.get("kakadu-layers") == 2
+
+        # page 0 always decodes every layer
+        image = pyvips.Image.kakaduload(filename, auto_layers=True)
+        assert image.get("kakadu-layers") == 6
+
+        # reduced pages need fewer layers, and look the same
+        image1 = pyvips.Image.kakaduload(filename, page=1)
+        image2 = pyvips.Image.kakaduload(filename, page=1, auto_layers=True)
+        assert image1.get("kakadu-layers") == 6
+        assert 0 < image2.get("kakadu-layers") < 6
+        assert abs(image1.avg() - image2.avg()) < 2
@@ -0,0 +1,74 @@
+# vim: set fileencoding=utf-8 :
+
+import sys
+import os
+import pytest
+
+import pyvips
+from helpers import *
+
+# a source which counts the bytes read from it
+def counting_source(filename, counter):
+    f = open(filename, "rb")
+
+    def read_handler(size):
+        chunk = f.read(size)
+        counter["bytes"] += len(chunk)
+        return chunk
+
+    def seek_handler(offset, whence):
+        f.seek(offset, whence)
+        return f.tell()
+
+    source = pyvips.SourceCustom()
+    source.on_read(read_handler)
+    source.on_seek(seek_handler)
+
+    return source
+
+class TestKakaduPlan:
+    def test_kakaduplan(self):
+        with open(JP2K_FILE, "rb") as f:
+            buf = f.read()
+
+        source = pyvips.Source.new_from_file(JP2K_FILE)
+        ranges = pyvips.Operation.call("kakaduplan", source,
+                                       left=0, top=0, width=64, height=64)
+
+        # sorted, separate ranges inside the file
+        assert len(ranges) > 0
+        assert len(ranges) % 2 == 0
+        pairs = [(int(ranges[i]), int(ranges[i + 1]))
+                 for i in range(0, len(ranges), 2)]
+        end = -1
+        for offset, length in pairs:
+            assert offset > end
+            assert length > 0
+            end = offset + length
+        assert end <= len(buf)
+
+        range_data = b"".join(buf[offset:offset + length]
+                              for offset, length in pairs)
+
+        counter1 = {"bytes": 0}
+        image1 = pyvips.Operation.call("kakaduload_source",
+                                       counting_source(JP2K_FILE, counter1))
+        image1 = image1.crop(0, 0, 64, 64).copy_memory()
+
+        counter2 = {"bytes": 0}
+        image2 = pyvips.Operation.call("kakaduload_source",
+                                       counting_source(JP2K_FILE, counter2),
+                                       ranges=ranges,
+                                       range_data=range_data)
+        image2 = image2.crop(0, 0, 64, 64).copy_memory()
+
+        # prefetched ranges never change pixels, and most reads should
+        # come from them
+        assert (image1 - image2).abs().max() == 0
+        assert counter2["bytes"] < counter1["bytes"]
+
+    def test_kakaduplan_bad_range_data(self):
+        with pytest.raises(pyvips.error.Error):
+            pyvips.Image.kakaduload(JP2K_FILE,
+                                    ranges=[0, 100],
+                                    range_data=b"short")
@@ -40,6 +40,21 @@ class TestKakaduSave:
         image = pyvips.Image.new_from_buffer(buf, "")
         self.image_matches_file(image, PPM_FILE)
 
+    def test_kakadusave_buffer_grow(self):
+        # the initial buffer is sized for 2:1 lossless compression, and 
+        # noise barely compresses at all, so save must grow it
+        bands = [pyvips.Image.gaussnoise(512, 512, sigma=64, mean=128)
+                 for i in range(3)]
+        # noise is regenerated on each evaluation, so render it once
+        image = bands[0].bandjoin(bands[1:]).cast("uchar") \
+            .copy(interpretation="srgb").copy_memory()
+        buf = image.kakadusave_buffer(lossless=True)
+        assert len(buf) > image.width * image.height * image.bands / 2
+        image2 = pyvips.Image.kakaduload_buffer(buf)
+        assert image2.width == image.width
+        assert image2.height == image.height
+        assert (image - image2).abs().max() == 0
+
     def test_kakadusave_options(self):
         q1 = self.ppm.kakadusave_buffer(options="Qfactor=1")
         q99 = self.ppm.kakadusave_buffer(options="Qfactor=99")
@@ -67,6 +82,38 @@ class TestKakaduSave:
         image = pyvips.Image.kakaduload_buffer(data)
         self.image_matches_file(image, PPM_FILE, 15)
 
+    def test_kakadusave_rate_and_Q(self):
+        # rate takes priority over Q, so we keep every rate layer
+        data = self.ppm.kakadusave_buffer(rate=[0.5, 1, 2], Q=30)
+        image = pyvips.Image.kakaduload_buffer(data)
+        assert image.get("kakadu-layers") == 3
+
+    def test_kakadusave_Q_unset(self):
+        # unset Q means no rate control, so setting the default Q is not
+        # the same as leaving it unset
+        data1 = self.ppm.kakadusave_buffer()
+        data2 = self.ppm.kakadusave_buffer(Q=48)
+        assert len(data2) < len(data1)
+
+    def test_kakadusave_rewrite(self):
+        # plt and tlm markers are patched in after the tile data is written
+        options = "ORGgen_plt=yes ORGgen_tlm=8"
+
+        filename = temp_filename(self.tempdir, ".jp2")
+        self.ppm.kakadusave(filename, options=options)
+        image = pyvips.Image.kakaduload(filename)
+        self.image_matches_file(image, PPM_FILE)
+
+        data = self.ppm.kakadusave_buffer(options=options)
+        image = pyvips.Image.kakaduload_buffer(data)
+        self.image_matches_file(image, PPM_FILE)
+
+        filename = temp_filename(self.tempdir, ".jp2")
+        target = pyvips.Target.new_to_file(filename)
+        self.ppm.kakadusave_target(target, options=options)
+        image = pyvips.Image.kakaduload(filename)
+        self.image_matches_file(image, PPM_FILE)
+
     def test_kakadusave_rate(self):
         data1 = self.ppm.kakadusave_buffer(rate=1)
         data10 = self.ppm.kakadusave_buffer(rate=10)
@@ -78,7 +125,60 @@ class TestKakaduSave:
         image10 = pyvips.Image.kakaduload_buffer(data10)
         self.image_matches_file(image10, PPM_FILE, 10)
 
+    def test_kakadusave_fractional_rate(self):
+        data1 = self.ppm.kakadusave_buffer(rate=0.5)
+        data2 = self.ppm.kakadusave_buffer(rate=[0.5, 1.5])
+        assert len(data1) < len(data2)
+
+        with pytest.raises(pyvips.error.Error):
+            self.ppm.kakadusave_buffer(rate=[2, 1])
+
+    def test_kakadusave_target_size(self):
+        data = self.ppm.kakadusave_buffer(target_size=20000)
+        assert len(data) <= 20000
+        assert len(data) > 10000
+
+        image = pyvips.Image.kakaduload_buffer(data)
+        self.image_matches_file(image, PPM_FILE, 100)
+
+    def test_kakadusave_slopes(self):
+        data1 = self.ppm.kakadusave_buffer(slopes=[46000])
+        data2 = self.ppm.kakadusave_buffer(slopes=[42000])
+        assert len(data1) < len(data2)
+
+        image = pyvips.Image.kakaduload_buffer(data2)
+        self.image_matches_file(image, PPM_FILE, 20)
+
+        data3 = self.ppm.kakadusave_buffer(Q=10)
+        data4 = self.ppm.kakadusave_buffer(Q=90)
+        assert len(data3) < len(data4)
+
+        with pytest.raises(pyvips.error.Error):
+            self.ppm.kakadusave_buffer(slopes=[42000, 46000])
+
     def test_kakadusave_profile(self):
         data = self.ppm.kakadusave_buffer(profile="srgb")
         image = pyvips.Image.kakaduload_buffer(data)
         assert len(image.get("icc-profile-data")) == 480
+
+    def test_kakadusave_preset(self):
+        for preset in ["fast", "balanced", "precise"]:
+            buf = self.ppm.kakadusave_buffer(preset=preset)
+            image = pyvips.Image.kakaduload_buffer(buf, preset="precise")
+            assert image.width == self.ppm.width
+            assert image.height == self.ppm.height
+            assert abs(image.avg() - self.ppm.avg()) < 1
+
+    def test_kakadusave_stats(self):
+        filename = temp_filename(self.tempdir, ".jp2")
+        result = self.ppm.kakadusave(filename, stats=True)
+
+        # bytes read, reads, seeks, bytes written, writes, tiles,
+        # process usec, threads, memory
+        stats = result["stats"]
+        assert len(stats) == 9
+        assert stats[0] == 0
+        assert stats[3] == os.path.getsize(filename)
+        assert stats[4] > 0
+        assert stats[5] > 0
+        assert stats[7] >= 1
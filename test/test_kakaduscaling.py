@@ -0,0 +1,114 @@
+# vim: set fileencoding=utf-8 :
+
+# check that peak memory use during load and save scales with tile or strip
+# size, not with image area
+#
+# these make and process 1, 4 and 16 gigapixel images, so they are slow and
+# need several GB of disc ... enable with eg.:
+#
+#   VIPS_KAKADU_SCALING_TESTS=1 pytest test/test_kakaduscaling.py
+#
+# and set the RSS cap in MB with VIPS_KAKADU_SCALING_RSS_CAP
+
+import sys
+import os
+import shutil
+import subprocess
+import tempfile
+import pytest
+
+import pyvips
+from helpers import *
+
+# image sizes, as width and height ... 1, 4 and 16 gigapixels
+SIZES = [32768, 65536, 131072]
+
+# no run can go over this many MB of RSS
+RSS_CAP = int(os.environ.get("VIPS_KAKADU_SCALING_RSS_CAP", "2048"))
+
+# the largest image can use at most this much more memory than the
+# smallest, in MB ... memory which scaled with area would need 16 times as
+# much
+RSS_SLACK = 256
+
+# each run is in a new process, so we see the peak for just that run
+CHILD = """
+import resource
+import sys
+import pyvips
+
+pyvips.cache_set_max(0)
+size = int(sys.argv[1])
+filename = sys.argv[2]
+options = sys.argv[3]
+
+def synthetic():
+    xyz = pyvips.Image.xyz(size, size)
+    # mask rather than cast, so we get a busy pattern rather than saturated
+    # white, and the compressed size grows with the image
+    return ((xyz[0] ^ xyz[1]) & 255).cast("uchar")
+
+{action}
+
+# ru_maxrss is in kB on linux
+print(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss // 1024)
+"""
+
+SAVE = "synthetic().kakadusave(filename, options=options)"
+LOAD = "pyvips.Image.kakaduload(filename).avg()"
+
+scaling = pytest.mark.skipif(
+    not os.environ.get("VIPS_KAKADU_SCALING_TESTS"),
+    reason="set VIPS_KAKADU_SCALING_TESTS to run scaling tests")
+
+
+# run an action in a new process, return peak RSS in MB
+def peak_rss(action, size, filename, options):
+    code = CHILD.format(action=action)
+    output = subprocess.run([sys.executable, "-c", code,
+                             str(size), filename, options],
+                            check=True, stdout=subprocess.PIPE).stdout
+
+    return int(output.decode().strip().split()[-1])
+
+
+@scaling
+class TestKakaduScaling:
+    tempdir = None
+
+    @classmethod
+    def setup_class(cls):
+        cls.tempdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        shutil.rmtree(cls.tempdir, ignore_errors=True)
+
+    def check_scaling(self, peaks):
+        print(f"peak RSS by size (MB): {peaks}")
+        for size, peak in peaks.items():
+            assert peak < RSS_CAP, \
+                f"{size} x {size} used {peak} MB, cap is {RSS_CAP} MB"
+        assert peaks[SIZES[-1]] < peaks[SIZES[0]] + RSS_SLACK, \
+            "peak memory is scaling with image area"
+
+    @pytest.mark.parametrize("options", ["", "Stiles={1024,1024}"])
+    def test_kakadusave_scaling(self, options):
+        peaks = {}
+        for size in SIZES:
+            filename = temp_filename(self.tempdir, ".jp2")
+            peaks[size] = peak_rss(SAVE, size, filename, options)
+            os.remove(filename)
+
+        self.check_scaling(peaks)
+
+    @pytest.mark.parametrize("options", ["", "Stiles={1024,1024}"])
+    def test_kakaduload_scaling(self, options):
+        peaks = {}
+        for size in SIZES:
+            filename = temp_filename(self.tempdir, ".jp2")
+            peak_rss(SAVE, size, filename, options)
+            peaks[size] = peak_rss(LOAD, size, filename, options)
+            os.remove(filename)
+
+        self.check_scaling(peaks)
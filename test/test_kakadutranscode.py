@@ -0,0 +1,92 @@
+# vim: set fileencoding=utf-8 :
+
+import sys
+import os
+import shutil
+import tempfile
+import pytest
+
+import pyvips
+from helpers import *
+
+class TestKakaduTranscode:
+    tempdir = None
+
+    @classmethod
+    def setup_class(cls):
+        cls.tempdir = tempfile.mkdtemp()
+
+    @classmethod
+    def teardown_class(cls):
+        shutil.rmtree(cls.tempdir, ignore_errors=True)
+
+    def test_kakadutranscode(self):
+        filename = temp_filename(self.tempdir, ".jp2")
+        pyvips.Operation.call("kakadutranscode", JP2K_FILE, filename,
+                              options="Corder=RPCL ORGgen_plt=yes")
+
+        # transcode is lossless with respect to the input codestream
+        image1 = pyvips.Image.kakaduload(JP2K_FILE)
+        image2 = pyvips.Image.kakaduload(filename)
+        assert image1.width == image2.width
+        assert image1.height == image2.height
+        assert image1.bands == image2.bands
+        assert (image1 - image2).abs().max() == 0
+
+    def test_kakadutranscode_htj2k(self):
+        jph = temp_filename(self.tempdir, ".jph")
+        pyvips.Operation.call("kakadutranscode", JP2K_FILE, jph, htj2k=True)
+        jp2 = temp_filename(self.tempdir, ".jp2")
+        pyvips.Operation.call("kakadutranscode", jph, jp2, htj2k=False)
+
+        image1 = pyvips.Image.kakaduload(JP2K_FILE)
+        for filename in [jph, jp2]:
+            image2 = pyvips.Image.kakaduload(filename)
+            assert (image1 - image2).abs().max() == 0
+
+    def test_kakadutranscode_page(self):
+        filename = temp_filename(self.tempdir, ".jp2")
+        pyvips.Operation.call("kakadutranscode", JP2K_FILE, filename, page=1)
+
+        image1 = pyvips.Image.kakaduload(JP2K_FILE, page=1)
+        image2 = pyvips.Image.kakaduload(filename)
+        assert image1.width == image2.width
+        assert image1.height == image2.height
+        assert (image1 - image2).abs().max() == 0
+
+    def test_kakadutranscode_layers(self):
+        image = pyvips.Image.kakaduload(JP2K_FILE)
+        layered = temp_filename(self.tempdir, ".jp2")
+        image.kakadusave(layered, rate=[0.25, 0.5, 1, 2, 4, 8])
+
+        filename = temp_filename(self.tempdir, ".jp2")
+        pyvips.Operation.call("kakadutranscode", layered, filename, layers=2)
+        assert os.path.getsize(filename) < os.path.getsize(layered)
+
+        # the first two layers are kept exactly
+        image1 = pyvips.Image.kakaduload(layered, layers=2)
+        image2 = pyvips.Image.kakaduload(filename)
+        assert image2.get("kakadu-layers") == 2
+        assert image1.width == image2.width
+        assert image1.height == image2.height
+        assert (image1 - image2).abs().max() == 0
+
+        # and still look like the source
+        assert abs(image.avg() - image2.avg()) < 2
+        assert (image - image2).abs().avg() < 10
+
+    def test_kakaduextract(self):
+        image = pyvips.Image.kakaduload(JP2K_FILE)
+        tiled = temp_filename(self.tempdir, ".jp2")
+        image.kakadusave(tiled, options="Stiles={64,64}")
+
+        # a 10x10 area at (70, 70) expands to the 64x64 tile at (64, 64)
+        filename = temp_filename(self.tempdir, ".jp2")
+        pyvips.Operation.call("kakaduextract", tiled, filename,
+                              70, 70, 10, 10)
+
+        image1 = pyvips.Image.kakaduload(tiled).crop(64, 64, 64, 64)
+        image2 = pyvips.Image.kakaduload(filename)
+        assert image2.width == 64
+        assert image2.height == 64
+        assert (image1 - image2).abs().max() == 0